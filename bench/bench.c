@@ -0,0 +1,238 @@
+#define _GNU_SOURCE
+#include "../wsh.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_SAMPLES 200
+#define NUM_BENCH_VARIABLES 100000
+#define NUM_HISTORY_LINES 65536
+#define HISTORY_BENCH_CAPACITY (1 << 20)
+#define NUM_PATH_DIRS 256
+
+typedef struct {
+  Shell *S;
+  Command *Cmd;
+  const char *Line;
+  size_t Len;
+  char **Lines;
+  size_t *Lens;
+  unsigned int Next;
+} BenchContext;
+
+typedef struct {
+  const char *Name;
+  void (*Setup)(BenchContext *);
+  void (*Op)(BenchContext *);
+  int OpsPerSample;
+  int Samples;
+} Benchmark;
+
+typedef struct {
+  double Mean;
+  double Min;
+  double P50;
+  double P90;
+  double P99;
+} BenchResult;
+
+static double getTimeNs(void) {
+  struct timespec Ts;
+  clock_gettime(CLOCK_MONOTONIC, &Ts);
+  return Ts.tv_sec * 1e9 + Ts.tv_nsec;
+}
+
+static int compareDoubles(const void *A, const void *B) {
+  double X = *(const double *)A;
+  double Y = *(const double *)B;
+  return (X > Y) - (X < Y);
+}
+
+static double getPercentile(double *Sorted, int Count, double P) {
+  int Index = (int)(P * (Count - 1) + 0.5);
+  return Sorted[Index];
+}
+
+static void setupGetCommand(BenchContext *C) {
+  C->Line = "grep -n \"some pattern\" file.txt | sort -k2 | uniq -c 2>err.log";
+  C->Len = strlen(C->Line);
+}
+
+static void runGetCommand(BenchContext *C) {
+  ArenaMark Mark = getArenaMark(C->S->Arena);
+  getCommand(C->Line, C->Len, C->S->Arena, C->S->Err);
+  releaseArena(C->S->Arena, Mark);
+}
+
+static void setupReplaceVariables(BenchContext *C) {
+  char Name[32];
+  for (int i = 0; i < NUM_BENCH_VARIABLES; i++) {
+    int Len = snprintf(Name, sizeof(Name), "V%d", i);
+    setLocalVariable(C->S->VA, Name, Len, "value");
+  }
+  const char *Line = "echo $V1 $V50000 $V99999 $MISSING literal \"quoted\"";
+  C->Cmd = getCommand(Line, strlen(Line), C->S->Arena, C->S->Err);
+}
+
+static void runReplaceVariables(BenchContext *C) {
+  ArenaMark Mark = getArenaMark(C->S->Arena);
+  replaceVariables(C->Cmd, C->S, 0);
+  releaseArena(C->S->Arena, Mark);
+}
+
+static void setupHistory(BenchContext *C) {
+  setHistoryCapacity(HISTORY_BENCH_CAPACITY, C->S->Hist);
+  C->Lines = (char **)malloc(NUM_HISTORY_LINES * sizeof(char *));
+  C->Lens = (size_t *)malloc(NUM_HISTORY_LINES * sizeof(size_t));
+  char Line[64];
+  for (int i = 0; i < NUM_HISTORY_LINES; i++) {
+    C->Lens[i] = snprintf(Line, sizeof(Line), "make -j8 target%d", i);
+    C->Lines[i] = strdup(Line);
+  }
+  for (int i = 0; i < HISTORY_BENCH_CAPACITY; i++)
+    addHistory(C->S->Hist, C->Lines[i % NUM_HISTORY_LINES],
+               C->Lens[i % NUM_HISTORY_LINES]);
+}
+
+static void runAddHistory(BenchContext *C) {
+  unsigned int i = C->Next++ % NUM_HISTORY_LINES;
+  addHistory(C->S->Hist, C->Lines[i], C->Lens[i]);
+}
+
+static void runGetHistory(BenchContext *C) {
+  C->Next = C->Next * 1103515245u + 12345u;
+  getHistory(1 + (C->Next >> 8) % C->S->Hist->Count, C->S->Hist);
+}
+
+static void setupLongPath(BenchContext *C) {
+  char *Path = (char *)malloc(NUM_PATH_DIRS * 32);
+  char *Out = Path;
+  for (int i = 0; i < NUM_PATH_DIRS - 1; i++)
+    Out += sprintf(Out, "/nonexistent/bin%d:", i);
+  strcpy(Out, "/bin");
+  setEnvironmentVariable(C->S->VA, "PATH", Path);
+  free(Path);
+}
+
+static void runFindExecutableCached(BenchContext *C) {
+  findExecutable("true", C->S->Cache);
+}
+
+static void runFindExecutableUncached(BenchContext *C) {
+  clearExecutableCache(C->S->Cache);
+  findExecutable("true", C->S->Cache);
+}
+
+static void setupSpawn(BenchContext *C) {
+  setEnvironmentVariable(C->S->VA, "PATH", "/bin:/usr/bin");
+  C->Line = "command true";
+  C->Len = strlen(C->Line);
+}
+
+static void runSpawn(BenchContext *C) {
+  Command *Cmd = getCommand(C->Line, C->Len, C->S->Arena, C->S->Err);
+  execute(Cmd, C->S);
+  resetArena(C->S->Arena);
+}
+
+static const Benchmark Benchmarks[] = {
+    {"getCommand/pipeline", setupGetCommand, runGetCommand, 1000, 0},
+    {"replaceVariables/100k", setupReplaceVariables, runReplaceVariables, 1000,
+     0},
+    {"addHistory/1M", setupHistory, runAddHistory, 1000, 0},
+    {"getHistory/1M", setupHistory, runGetHistory, 1000, 0},
+    {"findExecutable/cached", setupLongPath, runFindExecutableCached, 1000, 0},
+    {"findExecutable/256dirs", setupLongPath, runFindExecutableUncached, 10,
+     0},
+    {"execute/spawn", setupSpawn, runSpawn, 1, 500},
+};
+
+static BenchResult runBenchmark(const Benchmark *B) {
+  BenchContext C = {0};
+  C.S = initShell();
+  B->Setup(&C);
+  int Samples = B->Samples > 0 ? B->Samples : DEFAULT_SAMPLES;
+  double *Times = (double *)malloc(Samples * sizeof(double));
+  for (int i = 0; i < B->OpsPerSample; i++)
+    B->Op(&C);
+  for (int i = 0; i < Samples; i++) {
+    double Start = getTimeNs();
+    for (int j = 0; j < B->OpsPerSample; j++)
+      B->Op(&C);
+    Times[i] = (getTimeNs() - Start) / B->OpsPerSample;
+  }
+  qsort(Times, Samples, sizeof(double), compareDoubles);
+  BenchResult R = {0, Times[0], getPercentile(Times, Samples, 0.50),
+                   getPercentile(Times, Samples, 0.90),
+                   getPercentile(Times, Samples, 0.99)};
+  for (int i = 0; i < Samples; i++)
+    R.Mean += Times[i] / Samples;
+  free(Times);
+  if (C.Lines != NULL)
+    for (int i = 0; i < NUM_HISTORY_LINES; i++)
+      free(C.Lines[i]);
+  free(C.Lines);
+  free(C.Lens);
+  freeShell(C.S);
+  return R;
+}
+
+static int isSelected(const char *Name, int argc, char **argv, int First) {
+  if (First >= argc)
+    return 1;
+  for (int i = First; i < argc; i++)
+    if (strstr(Name, argv[i]) != NULL)
+      return 1;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  const char *OutPath = NULL;
+  const char *Label = "";
+  int First = 1;
+  while (First + 1 < argc && argv[First][0] == '-') {
+    if (strcmp(argv[First], "-o") == 0)
+      OutPath = argv[First + 1];
+    else if (strcmp(argv[First], "-l") == 0)
+      Label = argv[First + 1];
+    else
+      break;
+    First += 2;
+  }
+  if (First < argc && argv[First][0] == '-') {
+    fprintf(stderr, "usage: bench [-o <json>] [-l <label>] [filter...]\n");
+    return 1;
+  }
+  FILE *Out = NULL;
+  if (OutPath != NULL && (Out = fopen(OutPath, "w")) == NULL) {
+    perror("fopen");
+    return 1;
+  }
+  if (Out != NULL)
+    fprintf(Out, "{\"label\": \"%s\", \"benchmarks\": [", Label);
+  printf("%-26s %12s %12s %12s %12s %12s\n", "benchmark", "mean ns/op",
+         "min", "p50", "p90", "p99");
+  int NumRun = 0;
+  for (size_t i = 0; i < sizeof(Benchmarks) / sizeof(Benchmarks[0]); i++) {
+    const Benchmark *B = &Benchmarks[i];
+    if (!isSelected(B->Name, argc, argv, First))
+      continue;
+    BenchResult R = runBenchmark(B);
+    printf("%-26s %12.1f %12.1f %12.1f %12.1f %12.1f\n", B->Name, R.Mean,
+           R.Min, R.P50, R.P90, R.P99);
+    fflush(stdout);
+    if (Out != NULL)
+      fprintf(Out,
+              "%s\n  {\"name\": \"%s\", \"mean_ns\": %.1f, \"min_ns\": %.1f, "
+              "\"p50_ns\": %.1f, \"p90_ns\": %.1f, \"p99_ns\": %.1f}",
+              NumRun > 0 ? "," : "", B->Name, R.Mean, R.Min, R.P50, R.P90,
+              R.P99);
+    NumRun++;
+  }
+  if (Out != NULL) {
+    fprintf(Out, "\n]}\n");
+    fclose(Out);
+  }
+  return 0;
+}
@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_LINES 1000000
+#define DEFAULT_SPAWN_LINES 10000
+#define DEFAULT_RUNS 3
+#define DEFAULT_THRESHOLD 10
+#define NUM_SCRIPT_VARIABLES 1000
+#define MAX_PATH_LEN 1024
+
+extern char **environ;
+
+typedef enum { DialectWsh, DialectPosix } Dialect;
+
+typedef struct {
+  const char *Name;
+  void (*Generate)(FILE *, Dialect, int);
+  int Spawns;
+} Workload;
+
+typedef struct {
+  double LinesPerSec;
+  long PeakRSS;
+  long Syscalls;
+  int Status;
+} RunResult;
+
+typedef struct {
+  char Name[64];
+  double LinesPerSec;
+} BaselineEntry;
+
+static void writeAssignment(FILE *F, Dialect D, const char *Name, int i,
+                            const char *Value) {
+  fprintf(F, "%s%s%d=%s\n", D == DialectWsh ? "local " : "", Name, i, Value);
+}
+
+static void generateBuiltins(FILE *F, Dialect D, int NumLines) {
+  for (int i = 0; i < NumLines; i++) {
+    if (i % 2 == 0)
+      writeAssignment(F, D, "V", i % NUM_SCRIPT_VARIABLES, "value");
+    else
+      fprintf(F, "cd /tmp\n");
+  }
+}
+
+static void generateSpawns(FILE *F, Dialect D, int NumLines) {
+  (void)D;
+  for (int i = 0; i < NumLines; i++)
+    fprintf(F, i % 10 == 9 ? "/bin/true | /bin/true\n" : "/bin/true\n");
+}
+
+static void generateRedirections(FILE *F, Dialect D, int NumLines) {
+  (void)D;
+  for (int i = 0; i < NumLines; i++) {
+    if (i % 100 == 99)
+      fprintf(F, "/bin/true >out%d\n", i % 4);
+    else
+      fprintf(F, "cd . %sout%d\n", i % 2 == 0 ? ">" : ">>", i % 4);
+  }
+}
+
+static void generateVariables(FILE *F, Dialect D, int NumLines) {
+  for (int i = 0; i < NUM_SCRIPT_VARIABLES; i++)
+    writeAssignment(F, D, "D", i, "/tmp");
+  for (int i = NUM_SCRIPT_VARIABLES; i < NumLines; i++)
+    fprintf(F, "cd $D%d\n", (int)((i * 2654435761u) % NUM_SCRIPT_VARIABLES));
+}
+
+static const Workload Workloads[] = {
+    {"builtins", generateBuiltins, 0},
+    {"spawns", generateSpawns, 1},
+    {"redirections", generateRedirections, 0},
+    {"variables", generateVariables, 0},
+};
+
+static double getTimeSec(void) {
+  struct timespec Ts;
+  clock_gettime(CLOCK_MONOTONIC, &Ts);
+  return Ts.tv_sec + Ts.tv_nsec / 1e9;
+}
+
+static long countSyscalls(const char *Shell, const char *Script,
+                          const char *Dir) {
+  pid_t PID = fork();
+  if (PID == -1)
+    return -1;
+  if (PID == 0) {
+    int Null = open("/dev/null", O_RDWR);
+    dup2(Null, STDIN_FILENO);
+    dup2(Null, STDOUT_FILENO);
+    dup2(Null, STDERR_FILENO);
+    if (chdir(Dir) == -1 || ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1)
+      _exit(127);
+    raise(SIGSTOP);
+    execl(Shell, Shell, Script, (char *)NULL);
+    _exit(127);
+  }
+  int WaitStatus;
+  waitpid(PID, &WaitStatus, 0);
+  if (!WIFSTOPPED(WaitStatus)) {
+    return -1;
+  }
+  ptrace(PTRACE_SETOPTIONS, PID, NULL,
+         PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+  long Stops = 0;
+  int Signal = 0;
+  for (;;) {
+    if (ptrace(PTRACE_SYSCALL, PID, NULL, (void *)(long)Signal) == -1)
+      break;
+    if (waitpid(PID, &WaitStatus, 0) == -1 || WIFEXITED(WaitStatus) ||
+        WIFSIGNALED(WaitStatus))
+      break;
+    Signal = 0;
+    if (WSTOPSIG(WaitStatus) == (SIGTRAP | 0x80))
+      Stops++;
+    else if (WSTOPSIG(WaitStatus) != SIGTRAP &&
+             WSTOPSIG(WaitStatus) != SIGSTOP)
+      Signal = WSTOPSIG(WaitStatus);
+  }
+  return Stops / 2;
+}
+
+static RunResult runScript(const char *Shell, const char *Script,
+                           const char *Dir, int NumLines, int Runs,
+                           int CountSyscalls) {
+  RunResult R = {0, 0, -1, 0};
+  posix_spawn_file_actions_t Actions;
+  posix_spawn_file_actions_init(&Actions);
+  posix_spawn_file_actions_addopen(&Actions, STDIN_FILENO, "/dev/null",
+                                   O_RDONLY, 0);
+  posix_spawn_file_actions_addopen(&Actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  posix_spawn_file_actions_addopen(&Actions, STDERR_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  char *Argv[] = {(char *)Shell, (char *)Script, NULL};
+  char Cwd[MAX_PATH_LEN];
+  if (getcwd(Cwd, sizeof(Cwd)) == NULL || chdir(Dir) == -1) {
+    perror("chdir");
+    R.Status = 1;
+    return R;
+  }
+  for (int i = 0; i < Runs; i++) {
+    double Start = getTimeSec();
+    pid_t PID;
+    int Err = posix_spawn(&PID, Shell, &Actions, NULL, Argv, environ);
+    if (Err != 0) {
+      fprintf(stderr, "e2e: %s: %s\n", Shell, strerror(Err));
+      R.Status = 1;
+      break;
+    }
+    int WaitStatus;
+    struct rusage Usage;
+    wait4(PID, &WaitStatus, 0, &Usage);
+    double Elapsed = getTimeSec() - Start;
+    if (!WIFEXITED(WaitStatus))
+      R.Status = 1;
+    if (NumLines / Elapsed > R.LinesPerSec)
+      R.LinesPerSec = NumLines / Elapsed;
+    if (Usage.ru_maxrss > R.PeakRSS)
+      R.PeakRSS = Usage.ru_maxrss;
+  }
+  posix_spawn_file_actions_destroy(&Actions);
+  if (chdir(Cwd) == -1)
+    perror("chdir");
+  if (CountSyscalls && R.Status == 0)
+    R.Syscalls = countSyscalls(Shell, Script, Dir);
+  return R;
+}
+
+static int writeScript(const char *Path, const Workload *W, Dialect D,
+                       int NumLines) {
+  FILE *F = fopen(Path, "w");
+  if (F == NULL) {
+    perror("fopen");
+    return 1;
+  }
+  W->Generate(F, D, NumLines);
+  return fclose(F) != 0;
+}
+
+static int loadBaseline(const char *Path, BaselineEntry *Entries, int Max) {
+  FILE *F = fopen(Path, "r");
+  if (F == NULL) {
+    perror("fopen");
+    return -1;
+  }
+  int Count = 0;
+  char Line[512];
+  while (Count < Max && fgets(Line, sizeof(Line), F) != NULL) {
+    char *Name = strstr(Line, "\"name\": \"");
+    char *Rate = strstr(Line, "\"lines_per_sec\": ");
+    if (Name == NULL || Rate == NULL)
+      continue;
+    Name += strlen("\"name\": \"");
+    size_t Len = strcspn(Name, "\"");
+    if (Len >= sizeof(Entries[Count].Name))
+      continue;
+    memcpy(Entries[Count].Name, Name, Len);
+    Entries[Count].Name[Len] = '\0';
+    Entries[Count].LinesPerSec = atof(Rate + strlen("\"lines_per_sec\": "));
+    Count++;
+  }
+  fclose(F);
+  return Count;
+}
+
+static double findBaseline(const BaselineEntry *Entries, int Count,
+                           const char *Name) {
+  for (int i = 0; i < Count; i++)
+    if (strcmp(Entries[i].Name, Name) == 0)
+      return Entries[i].LinesPerSec;
+  return 0;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: e2e [-w <wsh>] [-d <dash>] [-n <lines>] "
+                  "[-r <runs>] [-o <json>] [-b <baseline json>] "
+                  "[-t <max drop %%, -1 disables>] [-S]\n");
+}
+
+int main(int argc, char **argv) {
+  const char *Wsh = "./wsh";
+  const char *Dash = "/bin/dash";
+  const char *OutPath = NULL;
+  const char *BaselinePath = NULL;
+  int NumLines = DEFAULT_LINES;
+  int Runs = DEFAULT_RUNS;
+  double Threshold = DEFAULT_THRESHOLD;
+  int CountSyscalls = 1;
+  int Opt;
+  while ((Opt = getopt(argc, argv, "w:d:n:r:o:b:t:S")) != -1) {
+    switch (Opt) {
+    case 'w':
+      Wsh = optarg;
+      break;
+    case 'd':
+      Dash = optarg;
+      break;
+    case 'n':
+      NumLines = atoi(optarg);
+      break;
+    case 'r':
+      Runs = atoi(optarg);
+      break;
+    case 'o':
+      OutPath = optarg;
+      break;
+    case 'b':
+      BaselinePath = optarg;
+      break;
+    case 't':
+      Threshold = atof(optarg);
+      break;
+    case 'S':
+      CountSyscalls = 0;
+      break;
+    default:
+      usage();
+      return 2;
+    }
+  }
+  if (NumLines < 1 || Runs < 1) {
+    usage();
+    return 2;
+  }
+  char WshPath[MAX_PATH_LEN];
+  if (realpath(Wsh, WshPath) == NULL) {
+    fprintf(stderr, "e2e: %s: %s\n", Wsh, strerror(errno));
+    return 2;
+  }
+  int HaveDash = access(Dash, X_OK) == 0;
+  BaselineEntry Baseline[16];
+  int NumBaseline = 0;
+  if (BaselinePath != NULL &&
+      (NumBaseline = loadBaseline(BaselinePath, Baseline, 16)) == -1)
+    return 2;
+  char Dir[] = "/tmp/wsh-e2e-XXXXXX";
+  if (mkdtemp(Dir) == NULL) {
+    perror("mkdtemp");
+    return 2;
+  }
+  FILE *Out = NULL;
+  if (OutPath != NULL && (Out = fopen(OutPath, "w")) == NULL) {
+    perror("fopen");
+    return 2;
+  }
+  if (Out != NULL)
+    fprintf(Out, "{\"lines\": %d, \"workloads\": [", NumLines);
+  printf("%-14s %9s %14s %10s %12s %14s %8s\n", "workload", "lines",
+         "wsh lines/s", "rss KiB", "syscalls", "dash lines/s", "ratio");
+  int Failed = 0;
+  for (size_t i = 0; i < sizeof(Workloads) / sizeof(Workloads[0]); i++) {
+    const Workload *W = &Workloads[i];
+    int Lines = W->Spawns && NumLines > DEFAULT_SPAWN_LINES
+                    ? DEFAULT_SPAWN_LINES
+                    : NumLines;
+    char WshScript[MAX_PATH_LEN];
+    char PosixScript[MAX_PATH_LEN];
+    snprintf(WshScript, sizeof(WshScript), "%s/%s.wsh", Dir, W->Name);
+    snprintf(PosixScript, sizeof(PosixScript), "%s/%s.sh", Dir, W->Name);
+    if (writeScript(WshScript, W, DialectWsh, Lines) ||
+        (HaveDash && writeScript(PosixScript, W, DialectPosix, Lines))) {
+      Failed = 1;
+      break;
+    }
+    RunResult R = runScript(WshPath, WshScript, Dir, Lines, Runs,
+                            CountSyscalls);
+    RunResult DashR = {0, 0, -1, 0};
+    if (HaveDash)
+      DashR = runScript(Dash, PosixScript, Dir, Lines, Runs, 0);
+    double Ratio = DashR.LinesPerSec > 0 ? R.LinesPerSec / DashR.LinesPerSec
+                                         : 0;
+    printf("%-14s %9d %14.0f %10ld %12ld %14.0f %8.2f\n", W->Name, Lines,
+           R.LinesPerSec, R.PeakRSS, R.Syscalls, DashR.LinesPerSec, Ratio);
+    double Reference = BaselinePath != NULL
+                           ? findBaseline(Baseline, NumBaseline, W->Name)
+                           : DashR.LinesPerSec;
+    if (R.Status != 0) {
+      fprintf(stderr, "e2e: %s: wsh did not exit cleanly\n", W->Name);
+      Failed = 1;
+    } else if (Threshold >= 0 && Reference > 0 &&
+               R.LinesPerSec < Reference * (1 - Threshold / 100)) {
+      fprintf(stderr, "e2e: %s: %.0f lines/s is more than %.1f%% below %.0f\n",
+              W->Name, R.LinesPerSec, Threshold, Reference);
+      Failed = 1;
+    }
+    if (Out != NULL)
+      fprintf(Out,
+              "%s\n  {\"name\": \"%s\", \"lines\": %d, \"lines_per_sec\": "
+              "%.1f, \"peak_rss_kib\": %ld, \"syscalls\": %ld, "
+              "\"dash_lines_per_sec\": %.1f}",
+              i > 0 ? "," : "", W->Name, Lines, R.LinesPerSec, R.PeakRSS,
+              R.Syscalls, DashR.LinesPerSec);
+    unlink(WshScript);
+    unlink(PosixScript);
+  }
+  if (Out != NULL) {
+    fprintf(Out, "\n]}\n");
+    fclose(Out);
+  }
+  for (int i = 0; i < 4; i++) {
+    char Path[MAX_PATH_LEN];
+    snprintf(Path, sizeof(Path), "%s/out%d", Dir, i);
+    unlink(Path);
+  }
+  rmdir(Dir);
+  return Failed;
+}
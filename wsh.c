@@ -1,29 +1,116 @@
+#define _GNU_SOURCE
 #include "wsh.h"
 #include <ctype.h>
-#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_INPUT_LEN 1024
-#define MAX_NUM_TOKENS 128
+#define READ_BUFFER_SIZE (1 << 20)
+#define PROMPT "wsh> "
+#define CONTINUATION_PROMPT "> "
 #define MAX_PATH_LEN 1024
 #define INITIAL_LOCAL_VARS_CAPACITY 128
 #define INITIAL_HISTORY_CAPACITY 5
+#define INITIAL_HISTORY_POOL_CAPACITY 16
+#define HISTORY_TAIL_WINDOW 65536
+#define INITIAL_HISTORY_INDEX_CAPACITY 1024
+#define INITIAL_POSTING_CAPACITY 4
+#define INITIAL_EXECUTABLE_CACHE_CAPACITY 64
+#define ARENA_BLOCK_SIZE 65536
+#define INITIAL_WORDS_CAPACITY 16
+#define SAVED_FD_MIN 10
+#define INITIAL_JOBS_CAPACITY 16
+#define INITIAL_JOB_TABLE_CAPACITY 64
+#define MAX_JOB_EVENTS 64
+#define PARALLEL_WINDOW_FACTOR 4
+#define CAPTURE_BUFFER_SIZE 4096
+#define WRITER_BUFFER_SIZE (1 << 18)
+#define DENTS_BUFFER_SIZE (1 << 20)
+#define INITIAL_DIR_ENTRIES_CAPACITY 1024
+#define STAT_WINDOW_SIZE 16384
+#define STAT_CHUNK_SIZE 256
+#define MAX_STAT_WORKERS 16
+#define INITIAL_PROFILE_CAPACITY 1024
+#define PROFILE_REPORT_LINES 20
+#define SCRIPT_CACHE_MAGIC 0x43485357
+#define SCRIPT_CACHE_VERSION 2
+#define INITIAL_BLOCK_DEPTH 8
+#define EXPANSION_BUFFER_SIZE 1024
+#define SUBSTITUTION_BUFFER_SIZE 65536
+#define COPY_CHUNK_SIZE (1 << 30)
+
+extern char **environ;
 
 const BuiltinCommandInfo BuiltinCommandInfoMap[] = {
-    {"exit", executeExitCommand},     {"cd", executeCdCommand},
-    {"export", executeExportCommand}, {"local", executeLocalCommand},
-    {"vars", executeVarsCommand},     {"history", executeHistoryCommand},
-    {"ls", executeLsCommand}};
+    {"exit", executeExitCommand, BuiltinMutates},
+    {"cd", executeCdCommand, BuiltinMutates},
+    {"export", executeExportCommand, BuiltinMutates},
+    {"local", executeLocalCommand, BuiltinMutates},
+    {"vars", executeVarsCommand, BuiltinReadOnly},
+    {"history", executeHistoryCommand, BuiltinReadOnlyBare},
+    {"ls", executeLsCommand, BuiltinReadOnly},
+    {"hash", executeHashCommand, BuiltinReadOnlyBare},
+    {"jobs", executeJobsCommand, BuiltinReadOnly},
+    {"wait", executeWaitCommand, BuiltinMutates},
+    {"fg", executeFgCommand, BuiltinMutates},
+    {"time", executeTimeCommand, BuiltinReadOnly},
+    {"stats", executeStatsCommand, BuiltinReadOnlyBare},
+    {"builtin", executeBuiltinCommand, BuiltinMutates},
+    {"echo", executeEchoCommand, BuiltinReadOnly},
+    {"true", executeTrueCommand, BuiltinReadOnly},
+    {"false", executeFalseCommand, BuiltinReadOnly},
+    {"test", executeTestCommand, BuiltinReadOnly},
+    {"[", executeTestCommand, BuiltinReadOnly},
+    {"printf", executePrintfCommand, BuiltinReadOnly},
+    {"cat", executeCatCommand, BuiltinReadsInput}};
 
 const int NumBuiltinCommands =
     sizeof(BuiltinCommandInfoMap) / sizeof(BuiltinCommandInfoMap[0]);
 
+const char *const BlockKeywords[] = {"",   "if",    "then", "elif", "else",
+                                     "fi", "while", "for",  "do",   "done"};
+
+const char *const TestBinaryOperators[] = {"=",   "==",  "!=",  "-eq",
+                                           "-ne", "-lt", "-le", "-gt",
+                                           "-ge"};
+
+const int NumTestBinaryOperators =
+    sizeof(TestBinaryOperators) / sizeof(TestBinaryOperators[0]);
+
+const ArithOperatorInfo ArithOperators[] = {
+    {"||", ArithOr, 1, 0},           {"&&", ArithAnd, 2, 0},
+    {"==", ArithEqual, 6, 0},        {"!=", ArithNotEqual, 6, 0},
+    {"<=", ArithLessEqual, 7, 0},    {">=", ArithGreaterEqual, 7, 0},
+    {"<<", ArithShiftLeft, 8, 1},    {">>", ArithShiftRight, 8, 1},
+    {"|", ArithBitOr, 3, 1},         {"^", ArithBitXor, 4, 1},
+    {"&", ArithBitAnd, 5, 1},        {"<", ArithLess, 7, 0},
+    {">", ArithGreater, 7, 0},       {"+", ArithAdd, 9, 1},
+    {"-", ArithSubtract, 9, 1},      {"*", ArithMultiply, 10, 1},
+    {"/", ArithDivide, 10, 1},       {"%", ArithModulo, 10, 1}};
+
+const int NumArithOperators =
+    sizeof(ArithOperators) / sizeof(ArithOperators[0]);
+
 const RedirectFlag RedirectFlags[] = {{0, 0},
                                       {O_RDONLY, 0},
                                       {O_WRONLY | O_CREAT | O_TRUNC, 0644},
@@ -31,15 +118,54 @@ const RedirectFlag RedirectFlags[] = {{0, 0},
                                       {O_WRONLY | O_CREAT | O_TRUNC, 0644},
                                       {O_WRONLY | O_CREAT | O_APPEND, 0644}};
 
+const char *const RedirectOps[] = {"", "<", ">", ">>", "&>", "&>>"};
+
+#ifndef WSH_NO_MAIN
 int main(int argc, char **argv) {
-  if (argc > 2) {
+  int Parallelism = 1;
+  const char *ProfilePath = NULL;
+  int Arg = 1;
+  int CacheScripts = 0;
+  for (; Arg < argc && argv[Arg][0] == '-' && argv[Arg][1] != '\0'; Arg++) {
+    if (strcmp(argv[Arg], "--cache") == 0) {
+      CacheScripts = 1;
+      continue;
+    }
+    if (strncmp(argv[Arg], "--profile=", 10) == 0) {
+      ProfilePath = argv[Arg] + 10;
+      continue;
+    }
+    if (strncmp(argv[Arg], "-j", 2) != 0) {
+      fprintf(stderr, "wsh: unknown option '%s'\n", argv[Arg]);
+      return 1;
+    }
+    const char *Value = argv[Arg][2] != '\0' ? argv[Arg] + 2 : argv[++Arg];
+    Parallelism = Value == NULL ? 0 : atoi(Value);
+    if (Parallelism < 1) {
+      fprintf(stderr, "wsh: usage: 'wsh -j <jobs> <script>'\n"
+                      "wsh: a 'wait' line waits for every earlier line\n");
+      return 1;
+    }
+  }
+  if (argc - Arg > 1) {
     fprintf(stderr, "wsh: takes one or no arguments\n");
     return 1;
   }
+  if (Arg == argc && (Parallelism > 1 || ProfilePath != NULL)) {
+    fprintf(stderr, "wsh: -j and --profile require a batch file\n");
+    return 1;
+  }
   Shell *S = initShell();
-  int Err = argc == 1 ? runInteractiveMode(S) : runBatchMode(S, argv[1]);
+  S->Parallelism = Parallelism;
+  S->CacheScripts = CacheScripts;
+  if (ProfilePath != NULL && (S->Prof = initProfiler(ProfilePath)) == NULL) {
+    fprintf(stderr, "wsh: error initializing\n");
+    exit(1);
+  }
+  int Err = Arg == argc ? runInteractiveMode(S) : runBatchMode(S, argv[Arg]);
   return -Err;
 }
+#endif
 
 Shell *initShell(void) {
   Shell *S = (Shell *)malloc(sizeof(Shell));
@@ -52,7 +178,7 @@ Shell *initShell(void) {
     fprintf(stderr, "wsh: error initializing\n");
     exit(1);
   }
-  if (setenv("PATH", "/bin", 1) < 0) {
+  if (setEnvironmentVariable(S->VA, "PATH", "/bin")) {
     fprintf(stderr, "wsh: error initializing\n");
     exit(1);
   }
@@ -61,7 +187,37 @@ Shell *initShell(void) {
     fprintf(stderr, "wsh: error initialzing\n");
     exit(1);
   }
+  S->Cache = initExecutableCache(INITIAL_EXECUTABLE_CACHE_CAPACITY);
+  if (S->Cache == NULL) {
+    fprintf(stderr, "wsh: error initializing\n");
+    exit(1);
+  }
+  S->Arena = initArena(ARENA_BLOCK_SIZE);
+  if (S->Arena == NULL) {
+    fprintf(stderr, "wsh: error initializing\n");
+    exit(1);
+  }
+  S->Jobs = initJobTable();
+  if (S->Jobs == NULL) {
+    fprintf(stderr, "wsh: error initializing\n");
+    exit(1);
+  }
+  S->Out = initWriter(STDOUT_FILENO, WRITER_BUFFER_SIZE);
+  S->Err = initWriter(STDERR_FILENO, WRITER_BUFFER_SIZE);
+  if (S->Out == NULL || S->Err == NULL) {
+    fprintf(stderr, "wsh: error initializing\n");
+    exit(1);
+  }
+  S->Interactive = 0;
+  S->Parallelism = 1;
+  S->CacheScripts = 0;
+  S->Prof = NULL;
+  S->Block = NULL;
+  memset(&S->LastUsage, 0, sizeof(ResourceUsage));
+  resetStats(S);
   S->Error = 0;
+  S->SubstitutionStatus = -1;
+  S->Substitutions = 0;
   return S;
 }
 
@@ -70,581 +226,4164 @@ void freeShell(Shell *S) {
     return;
   freeLocalVariableArray(S->VA);
   freeHistory(S->Hist);
+  freeExecutableCache(S->Cache);
+  freeArena(S->Arena);
+  freeJobTable(S->Jobs);
+  if (S->Prof != NULL) {
+    reportProfile(S->Prof, S->Err);
+    writeProfile(S->Prof);
+    freeProfiler(S->Prof);
+  }
+  flushShellOutput(S);
+  freeWriter(S->Out);
+  freeWriter(S->Err);
   free(S);
 }
 
 int runInteractiveMode(Shell *S) {
-  char Input[MAX_INPUT_LEN];
+  LineEditor *E = NULL;
+  LineReader *R = NULL;
+  if (isatty(STDIN_FILENO))
+    E = initLineEditor(STDIN_FILENO);
+  else
+    R = initLineReader(STDIN_FILENO);
+  if (E == NULL && R == NULL) {
+    fprintf(stderr, "wsh: error initializing\n");
+    exit(1);
+  }
+  S->Interactive = 1;
+  initHistoryFile(S, 1);
+  startHistoryIndex(S->Hist);
+  const char *Line;
+  size_t Len;
   for (;;) {
-    printf("wsh> ");
-    fflush(stdout);
-    if (fgets(Input, sizeof(Input), stdin) == NULL) {
+    updateJobs(S);
+    const char *Prompt = S->Block != NULL ? CONTINUATION_PROMPT : PROMPT;
+    writeBytes(S->Out, Prompt, strlen(Prompt));
+    flushShellOutput(S);
+    if (!(E != NULL ? editLine(E, S, Prompt, &Line, &Len)
+                    : readLine(R, &Line, &Len)))
       break;
-    }
-    fflush(stdout);
-    Input[strcspn(Input, "\n")] = 0;
-    if (strlen(Input) == 0)
-      continue;
-    Command *Cmd = getCommand(Input, S->VA);
-    if (Cmd == NULL)
-      continue;
-    S->Error = execute(Cmd, S);
-    freeCommand(Cmd);
+    if (R != NULL)
+      syncLineReader(R);
+    Command *Cmd = parseLine(S, Line, Len);
+    if (Cmd != NULL)
+      runCommand(S, Cmd);
+    if (S->Block == NULL)
+      resetArena(S->Arena);
   }
+  endBlockInput(S);
+  freeLineEditor(E);
+  freeLineReader(R);
   int Error = S->Error;
   freeShell(S);
   return Error;
 }
 
 int runBatchMode(Shell *S, const char *Path) {
-  FILE *File = fopen(Path, "r");
-  if (File == NULL) {
-    perror("fopen");
+  int FD = STDIN_FILENO;
+  if (strcmp(Path, "-") != 0) {
+    FD = open(Path, O_RDONLY | O_CLOEXEC);
+    if (FD == -1) {
+      perror("open");
+      exit(1);
+    }
+  }
+  struct stat St;
+  char *CachePath = NULL;
+  if (S->CacheScripts && S->Parallelism == 1 && FD != STDIN_FILENO &&
+      fstat(FD, &St) == 0 && S_ISREG(St.st_mode) &&
+      (CachePath = getScriptCachePath(Path)) != NULL) {
+    ScriptCache *SC = loadScriptCache(CachePath, Path, &St);
+    if (SC == NULL && compileScript(S, FD, CachePath, Path, &St) == 0)
+      SC = loadScriptCache(CachePath, Path, &St);
+    free(CachePath);
+    if (SC != NULL) {
+      initHistoryFile(S, 0);
+      close(FD);
+      runCachedScript(S, SC);
+      freeScriptCache(SC);
+      int Error = S->Error;
+      freeShell(S);
+      return Error;
+    }
+    lseek(FD, 0, SEEK_SET);
+  }
+  LineReader *R = initLineReader(FD);
+  if (R == NULL) {
+    fprintf(stderr, "wsh: error initializing\n");
     exit(1);
   }
-  char Buffer[MAX_INPUT_LEN];
-  while (fgets(Buffer, sizeof(Buffer), File) != 0) {
-    Buffer[strcspn(Buffer, "\n")] = 0;
-    if (strlen(Buffer) == 0)
-      continue;
-    Command *Cmd = getCommand(Buffer, S->VA);
-    if (Cmd == NULL)
-      continue;
-    S->Error = execute(Cmd, S);
-    freeCommand(Cmd);
+  R->Shared = R->Shared && S->Parallelism == 1;
+  initHistoryFile(S, 0);
+  if (S->Parallelism > 1) {
+    runParallelBatch(S, R);
+  } else {
+    const char *Line;
+    size_t Len;
+    while (readLine(R, &Line, &Len)) {
+      syncLineReader(R);
+      updateJobs(S);
+      flushShellErrors(S);
+      double LineStart = startLineSpan(S);
+      Command *Cmd = parseLine(S, Line, Len);
+      if (Cmd != NULL)
+        runCommand(S, Cmd);
+      endLineSpan(S, Line, Len, LineStart);
+      if (S->Block == NULL)
+        resetArena(S->Arena);
+    }
+    endBlockInput(S);
   }
+  freeLineReader(R);
+  if (FD != STDIN_FILENO)
+    close(FD);
   int Error = S->Error;
   freeShell(S);
   return Error;
 }
 
-char *findExecutable(const char *ExeToken) {
-  if (ExeToken == NULL)
-    return NULL;
-  static char ExecutablePath[MAX_PATH_LEN];
-  char *Exe = strdup(ExeToken);
-  if (Exe == NULL) {
-    perror("strdup");
-    return NULL;
+int runParallelBatch(Shell *S, LineReader *R) {
+  ParallelRunner *PR = initParallelRunner(S);
+  if (PR == NULL) {
+    fprintf(stderr, "wsh: error initializing\n");
+    exit(1);
   }
-  if (strchr(Exe, '/') != NULL) {
-    if (access(Exe, X_OK) == 0)
-      return Exe;
-    free(Exe);
-    return NULL;
+  const char *Line;
+  size_t Len;
+  while (readLine(R, &Line, &Len)) {
+    syncLineReader(R);
+    flushShellErrors(S);
+    Command *Cmd = parseLine(S, Line, Len);
+    if (Cmd == NULL) {
+      if (S->Block == NULL)
+        resetArena(S->Arena);
+      continue;
+    }
+    if (S->Block != NULL || !isParallelCommand(Cmd)) {
+      while (PR->Count > 0)
+        stepParallelRunner(PR, S, -1);
+      runCommand(S, Cmd);
+      if (S->Block == NULL)
+        resetArena(S->Arena);
+      continue;
+    }
+    while (PR->Running == S->Parallelism || PR->Count == PR->Capacity)
+      stepParallelRunner(PR, S, -1);
+    launchParallelLine(PR, Cmd, S);
+    resetArena(S->Arena);
   }
-  char *Path = getenv("PATH");
-  if (Path == NULL) {
-    free(Exe);
-    return NULL;
+  while (PR->Count > 0)
+    stepParallelRunner(PR, S, -1);
+  endBlockInput(S);
+  freeParallelRunner(PR);
+  return S->Error;
+}
+
+int runCachedScript(Shell *S, ScriptCache *SC) {
+  const char *Strings = SC->Map + SC->Size - SC->Header->StringsSize;
+  for (uint32_t i = 0; i < SC->Header->NumLines; i++) {
+    const CachedLine *CL = &SC->Lines[i];
+    const char *Line = Strings + CL->Text;
+    updateJobs(S);
+    flushShellErrors(S);
+    double LineStart = startLineSpan(S);
+    Command *Cmd = CL->NumStages > 0 ? &SC->Commands[CL->FirstStage]
+                                     : parseLine(S, Line, CL->TextLen);
+    if (Cmd != NULL)
+      runCommand(S, Cmd);
+    endLineSpan(S, Line, CL->TextLen, LineStart);
+    if (S->Block == NULL)
+      resetArena(S->Arena);
   }
-  char *Dir = strtok(Path, ":");
-  while (Dir != NULL) {
-    snprintf(ExecutablePath, sizeof(ExecutablePath), "%s%s%s", Dir, "/", Exe);
-    if (access(ExecutablePath, X_OK) == 0) {
-      free(Exe);
-      return ExecutablePath;
-    }
-    Dir = strtok(NULL, ":");
+  endBlockInput(S);
+  return S->Error;
+}
+
+int runCommand(Shell *S, Command *Cmd) {
+  if (S->Block == NULL && getBlockKeyword(Cmd) == KeywordNone)
+    return S->Error = execute(Cmd, S);
+  if (S->Block == NULL)
+    S->Block = initBlockParser(S->Arena);
+  int Done = addBlockLine(S->Block, Cmd, S->Arena, S->Err);
+  if (Done == 0)
+    return S->Error;
+  Node *Root = S->Block->Root;
+  S->Block = NULL;
+  if (Done == -1)
+    return S->Error = 1;
+  return S->Error = executeNode(Root, S);
+}
+
+void endBlockInput(Shell *S) {
+  if (S->Block == NULL)
+    return;
+  writeFormat(S->Err, "wsh: syntax error: unexpected end of file\n");
+  S->Block = NULL;
+  S->Error = 1;
+  resetArena(S->Arena);
+}
+
+int compileScript(Shell *S, int FD, const char *CachePath, const char *Path,
+                  const struct stat *St) {
+  ScriptCompiler *C = initScriptCompiler();
+  LineReader *R = initLineReader(FD);
+  Writer *Discard = initWriter(-1, CAPTURE_BUFFER_SIZE);
+  int Error = C == NULL || R == NULL || Discard == NULL;
+  const char *Line;
+  size_t Len;
+  while (!Error && readLine(R, &Line, &Len)) {
+    Command *Cmd = getCommand(Line, Len, S->Arena, Discard);
+    Error = addCompiledLine(C, Line, Len, Cmd);
+    Discard->Len = 0;
+    resetArena(S->Arena);
   }
-  free(Exe);
-  return NULL;
+  if (!Error)
+    Error = writeScriptCache(C, CachePath, Path, St);
+  freeWriter(Discard);
+  freeLineReader(R);
+  freeScriptCompiler(C);
+  return Error;
 }
 
-int openRedirect(Redirect *R) {
-  if (R == NULL || R->File == NULL || R->Mode == RedirectNone)
-    return -1;
-  int fd =
-      open(R->File, RedirectFlags[R->Mode].Flags, RedirectFlags[R->Mode].Mode);
-  if (fd == -1)
-    fprintf(stderr, "%s: no such file or directory\n", R->File);
-  return fd;
+char *getScriptCachePath(const char *Path) {
+  const char *Base = strrchr(Path, '/');
+  int DirLen = Base == NULL ? 0 : (int)(Base - Path + 1);
+  Base = Base == NULL ? Path : Base + 1;
+  size_t Size = strlen(Path) + sizeof("..wshc");
+  char *CachePath = (char *)malloc(Size);
+  if (CachePath != NULL)
+    snprintf(CachePath, Size, "%.*s.%s.wshc", DirLen, Path, Base);
+  return CachePath;
 }
 
-int redirect(Redirect *R) {
-  if (R == NULL || R->File == NULL)
-    return 1;
-  if (R->Mode == RedirectNone)
+int reserveArray(void **Data, int *Capacity, int Count, size_t Size) {
+  if (Count < *Capacity)
+    return 0;
+  int NewCapacity = *Capacity == 0 ? INITIAL_WORDS_CAPACITY : *Capacity * 2;
+  while (NewCapacity <= Count)
+    NewCapacity *= 2;
+  void *NewData = realloc(*Data, NewCapacity * Size);
+  if (NewData == NULL)
     return 1;
+  *Data = NewData;
+  *Capacity = NewCapacity;
+  return 0;
+}
 
-  int fd = openRedirect(R);
-  if (fd == -1)
-    return 0;
+ScriptCompiler *initScriptCompiler(void) {
+  ScriptCompiler *C = (ScriptCompiler *)calloc(1, sizeof(ScriptCompiler));
+  if (C != NULL && addCompiledString(C, "", 0) == (uint32_t)-1) {
+    free(C);
+    return NULL;
+  }
+  return C;
+}
 
-  if (R->FD >= 0)
-    return dup2(fd, R->FD) != -1;
+uint32_t addCompiledString(ScriptCompiler *C, const char *Str, size_t Len) {
+  if (Len > INT32_MAX - (size_t)C->StringsSize - 1 ||
+      reserveArray((void **)&C->Strings, &C->StringsCapacity,
+                   C->StringsSize + Len + 1, 1))
+    return (uint32_t)-1;
+  uint32_t Offset = C->StringsSize;
+  memcpy(C->Strings + Offset, Str, Len);
+  C->Strings[Offset + Len] = '\0';
+  C->StringsSize += Len + 1;
+  return Offset;
+}
 
-  switch (R->Mode) {
-  case RedirectInput:
-    return dup2(fd, STDIN_FILENO) != -1;
-  case RedirectOutput:
-  case RedirectAppend:
-    return dup2(fd, STDOUT_FILENO) != -1;
-  case RedirectOuputError:
-  case RedirectAppendError:
-    return dup2(fd, STDOUT_FILENO) != -1 && dup2(fd, STDERR_FILENO) != 1;
-  default:
+int addCompiledLine(ScriptCompiler *C, const char *Line, size_t Len,
+                    Command *Cmd) {
+  if (reserveArray((void **)&C->Lines, &C->LinesCapacity, C->NumLines,
+                   sizeof(CachedLine)))
+    return 1;
+  CachedLine *CL = &C->Lines[C->NumLines];
+  CL->Text = addCompiledString(C, Line, Len);
+  CL->TextLen = Len;
+  CL->FirstStage = C->NumStages;
+  CL->NumStages = 0;
+  if (CL->Text == (uint32_t)-1)
+    return 1;
+  for (Command *Stage = Cmd; Stage != NULL; Stage = Stage->Next) {
+    if (reserveArray((void **)&C->Stages, &C->StagesCapacity, C->NumStages,
+                     sizeof(CachedStage)) ||
+        reserveArray((void **)&C->Tokens, &C->TokensCapacity,
+                     C->NumTokens + Stage->TokenCount, sizeof(uint32_t)))
+      return 1;
+    CachedStage *CS = &C->Stages[C->NumStages++];
+    memset(CS, 0, sizeof(CachedStage));
+    CS->FirstToken = C->NumTokens;
+    CS->NumTokens = Stage->TokenCount;
+    CS->Background = Stage->Background;
+    CS->Timed = Stage->Timed;
+    CS->External = Stage->External;
+    CS->RedirectMode = RedirectNone;
+    if (Stage->Redirection != NULL) {
+      Redirect *R = Stage->Redirection;
+      CS->RedirectMode = R->Mode;
+      CS->RedirectFD = R->FD;
+      CS->RedirectFile = addCompiledString(C, R->File, strlen(R->File));
+      if (CS->RedirectFile == (uint32_t)-1)
+        return 1;
+    }
+    for (int i = 0; i < Stage->TokenCount; i++) {
+      uint32_t Offset = addCompiledString(C, Stage->Tokens[i],
+                                          strlen(Stage->Tokens[i]));
+      if (Offset == (uint32_t)-1)
+        return 1;
+      C->Tokens[C->NumTokens++] = Offset;
+    }
+    CL->NumStages++;
+  }
+  C->NumLines++;
+  return 0;
+}
+
+int writeScriptCache(ScriptCompiler *C, const char *CachePath,
+                     const char *Path, const struct stat *St) {
+  uint32_t PathOffset = addCompiledString(C, Path, strlen(Path));
+  if (PathOffset == (uint32_t)-1)
+    return 1;
+  ScriptCacheHeader Header;
+  memset(&Header, 0, sizeof(Header));
+  Header.Magic = SCRIPT_CACHE_MAGIC;
+  Header.Version = SCRIPT_CACHE_VERSION;
+  Header.Size = St->st_size;
+  Header.MTime = St->st_mtim.tv_sec;
+  Header.MTimeNsec = St->st_mtim.tv_nsec;
+  Header.Device = St->st_dev;
+  Header.Inode = St->st_ino;
+  Header.Path = PathOffset;
+  Header.NumLines = C->NumLines;
+  Header.NumStages = C->NumStages;
+  Header.NumTokens = C->NumTokens;
+  Header.StringsSize = C->StringsSize;
+  struct iovec Vec[] = {
+      {&Header, sizeof(Header)},
+      {C->Lines, C->NumLines * sizeof(CachedLine)},
+      {C->Stages, C->NumStages * sizeof(CachedStage)},
+      {C->Tokens, C->NumTokens * sizeof(uint32_t)},
+      {C->Strings, C->StringsSize}};
+  size_t Size = strlen(CachePath) + 16;
+  char *TempPath = (char *)malloc(Size);
+  if (TempPath == NULL)
+    return 1;
+  snprintf(TempPath, Size, "%s.%d", CachePath, (int)getpid());
+  int FD = open(TempPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (FD == -1) {
+    free(TempPath);
     return 1;
   }
+  int Err = writeAllVector(FD, Vec, sizeof(Vec) / sizeof(Vec[0]));
+  if (close(FD) == -1 || Err || rename(TempPath, CachePath) == -1) {
+    unlink(TempPath);
+    Err = 1;
+  }
+  free(TempPath);
+  return Err;
+}
+
+void freeScriptCompiler(ScriptCompiler *C) {
+  if (C == NULL)
+    return;
+  free(C->Lines);
+  free(C->Stages);
+  free(C->Tokens);
+  free(C->Strings);
+  free(C);
 }
 
-Command *getCommand(char *Input, LocalVariableArray *VA) {
-  if (Input == NULL || VA == NULL)
+ScriptCache *loadScriptCache(const char *CachePath, const char *Path,
+                             const struct stat *St) {
+  int FD = open(CachePath, O_RDONLY | O_CLOEXEC);
+  if (FD == -1)
     return NULL;
-  Command *Cmd = (Command *)malloc(sizeof(Command));
-  if (Cmd == NULL)
+  struct stat CacheSt;
+  void *Map = MAP_FAILED;
+  if (fstat(FD, &CacheSt) == 0 &&
+      (size_t)CacheSt.st_size >= sizeof(ScriptCacheHeader))
+    Map = mmap(NULL, CacheSt.st_size, PROT_READ, MAP_PRIVATE, FD, 0);
+  close(FD);
+  if (Map == MAP_FAILED)
+    return NULL;
+  ScriptCache *SC = (ScriptCache *)calloc(1, sizeof(ScriptCache));
+  if (SC == NULL) {
+    munmap(Map, CacheSt.st_size);
     return NULL;
-  Cmd->Tokens = NULL;
-  Cmd->TokenCount = 0;
-  Cmd->Redirection = NULL;
-  Cmd->Tokens = (char **)calloc(MAX_NUM_TOKENS, sizeof(char *));
-  if (Cmd->Tokens == NULL) {
-    free(Cmd);
-    return NULL;
-  }
-  Cmd->Tokens[0] = '\0';
-  Cmd->TokenCount = 0;
-  char *Token = strtok(Input, " ");
-  while (Token != NULL && Cmd->TokenCount < MAX_NUM_TOKENS) {
-    Cmd->Tokens[Cmd->TokenCount] = strdup(Token);
-    if (Cmd->Tokens[Cmd->TokenCount] == NULL) {
-      freeCommand(Cmd);
-      return NULL;
-    }
-    Cmd->TokenCount++;
-    Token = strtok(NULL, " ");
   }
-  if (Cmd->TokenCount == 0) {
-    freeCommand(Cmd);
+  SC->Map = (char *)Map;
+  SC->Size = CacheSt.st_size;
+  SC->Header = (const ScriptCacheHeader *)Map;
+  const ScriptCacheHeader *H = SC->Header;
+  if (H->Magic != SCRIPT_CACHE_MAGIC || H->Version != SCRIPT_CACHE_VERSION ||
+      H->Size != (uint64_t)St->st_size || H->MTime != St->st_mtim.tv_sec ||
+      H->MTimeNsec != St->st_mtim.tv_nsec || H->Device != St->st_dev ||
+      H->Inode != St->st_ino || linkScriptCache(SC, strlen(Path)) ||
+      strcmp(SC->Map + SC->Size - H->StringsSize + H->Path, Path) != 0) {
+    freeScriptCache(SC);
     return NULL;
   }
-  if (Cmd->TokenCount > 1) {
-    char *LastToken = strdup(Cmd->Tokens[Cmd->TokenCount - 1]);
-    if (LastToken == NULL) {
-      perror("strdup");
-      freeCommand(Cmd);
-      return NULL;
-    }
-    Cmd->Redirection = (Redirect *)malloc(sizeof(Redirect));
-    if (Cmd->Redirection == NULL) {
-      freeCommand(Cmd);
-      free(LastToken);
-      return NULL;
-    }
-    Cmd->Redirection->File = NULL;
-    int RedirectLen;
-    Cmd->Redirection->FD = -1;
-    if (strstr(LastToken, "&>>")) {
-      Cmd->Redirection->Mode = RedirectAppendError;
-      RedirectLen = 3;
-    } else if (strstr(LastToken, ">>")) {
-      Cmd->Redirection->Mode = RedirectAppend;
-      RedirectLen = 2;
-    } else if (strstr(LastToken, "&>")) {
-      Cmd->Redirection->Mode = RedirectOuputError;
-      RedirectLen = 2;
-    } else if (strchr(LastToken, '>')) {
-      Cmd->Redirection->Mode = RedirectOutput;
-      RedirectLen = 1;
-    } else if (strchr(LastToken, '<')) {
-      Cmd->Redirection->Mode = RedirectInput;
-      RedirectLen = 1;
-    } else {
-      Cmd->Redirection->Mode = RedirectNone;
-      RedirectLen = 0;
-    }
-    char *EndPtr;
-    if (Cmd->Redirection->Mode != RedirectNone) {
-      if (isdigit(LastToken[0])) {
-        Cmd->Redirection->FD = (int)strtol(LastToken, &EndPtr, 10);
-        Cmd->Redirection->File = strdup(EndPtr + RedirectLen);
-        if (Cmd->Redirection->File == NULL) {
-          perror("strdup");
-          freeCommand(Cmd);
-          free(LastToken);
-          return NULL;
-        }
-      } else {
-        Cmd->Redirection->File = strdup(LastToken + RedirectLen);
-        if (Cmd->Redirection->File == NULL) {
-          perror("strdup");
-          freeCommand(Cmd);
-          free(LastToken);
-          return NULL;
-        }
-      }
+  return SC;
+}
+
+int linkScriptCache(ScriptCache *SC, size_t PathLen) {
+  const ScriptCacheHeader *H = SC->Header;
+  size_t Expected = sizeof(ScriptCacheHeader) +
+                    (size_t)H->NumLines * sizeof(CachedLine) +
+                    (size_t)H->NumStages * sizeof(CachedStage) +
+                    (size_t)H->NumTokens * sizeof(uint32_t) + H->StringsSize;
+  if (Expected != SC->Size || H->StringsSize == 0 ||
+      H->Path + PathLen >= H->StringsSize)
+    return 1;
+  SC->Lines = (const CachedLine *)(SC->Map + sizeof(ScriptCacheHeader));
+  const CachedStage *Stages = (const CachedStage *)(SC->Lines + H->NumLines);
+  const uint32_t *Tokens = (const uint32_t *)(Stages + H->NumStages);
+  char *Strings = (char *)(Tokens + H->NumTokens);
+  if (Strings[H->StringsSize - 1] != '\0')
+    return 1;
+  SC->Commands = (Command *)calloc(H->NumStages + 1, sizeof(Command));
+  SC->Redirects = (Redirect *)calloc(H->NumStages + 1, sizeof(Redirect));
+  SC->Words = (char **)calloc((size_t)H->NumTokens + H->NumStages + 1,
+                              sizeof(char *));
+  if (SC->Commands == NULL || SC->Redirects == NULL || SC->Words == NULL)
+    return 1;
+  for (uint32_t i = 0; i < H->NumTokens; i++) {
+    if (Tokens[i] >= H->StringsSize)
+      return 1;
+  }
+  for (uint32_t i = 0; i < H->NumStages; i++) {
+    const CachedStage *CS = &Stages[i];
+    Command *Stage = &SC->Commands[i];
+    if (CS->NumTokens == 0 || CS->FirstToken > H->NumTokens ||
+        CS->NumTokens > H->NumTokens - CS->FirstToken ||
+        CS->RedirectMode > RedirectAppendError ||
+        CS->RedirectFile >= H->StringsSize)
+      return 1;
+    Stage->Tokens = SC->Words + CS->FirstToken + i;
+    for (uint32_t j = 0; j < CS->NumTokens; j++)
+      Stage->Tokens[j] = Strings + Tokens[CS->FirstToken + j];
+    Stage->TokenCount = CS->NumTokens;
+    Stage->Background = CS->Background;
+    Stage->Timed = CS->Timed;
+    Stage->External = CS->External;
+    if (CS->RedirectMode != RedirectNone) {
+      Stage->Redirection = &SC->Redirects[i];
+      Stage->Redirection->Mode = (RedirectMode)CS->RedirectMode;
+      Stage->Redirection->FD = CS->RedirectFD;
+      Stage->Redirection->File = Strings + CS->RedirectFile;
     }
-    free(LastToken);
   }
-  return Cmd->Tokens[0][0] == '#' ? NULL : Cmd;
+  for (uint32_t i = 0; i < H->NumLines; i++) {
+    const CachedLine *CL = &SC->Lines[i];
+    if (CL->TextLen >= H->StringsSize ||
+        CL->Text >= H->StringsSize - CL->TextLen ||
+        CL->FirstStage > H->NumStages ||
+        CL->NumStages > H->NumStages - CL->FirstStage)
+      return 1;
+    for (uint32_t j = 1; j < CL->NumStages; j++)
+      SC->Commands[CL->FirstStage + j - 1].Next =
+          &SC->Commands[CL->FirstStage + j];
+  }
+  return 0;
 }
 
-Command *getCommandCopy(Command *Cmd) {
-  if (Cmd == NULL)
-    return NULL;
-  Command *CmdCpy = (Command *)malloc(sizeof(Command));
-  if (CmdCpy == NULL)
+void freeScriptCache(ScriptCache *SC) {
+  if (SC == NULL)
+    return;
+  munmap(SC->Map, SC->Size);
+  free(SC->Commands);
+  free(SC->Redirects);
+  free(SC->Words);
+  free(SC);
+}
+
+LineReader *initLineReader(int FD) {
+  LineReader *R = (LineReader *)calloc(1, sizeof(LineReader));
+  if (R == NULL)
     return NULL;
-  CmdCpy->Tokens = NULL;
-  CmdCpy->Redirection = (Redirect *)malloc(sizeof(Redirect));
-  if (CmdCpy->Redirection == NULL) {
-    freeCommand(CmdCpy);
+  R->FD = FD;
+  R->Shared = FD == STDIN_FILENO;
+  R->Seekable = lseek(FD, 0, SEEK_CUR) != -1;
+  R->Offset = -1;
+  struct stat St;
+  if (!R->Shared && fstat(FD, &St) == 0 && S_ISREG(St.st_mode) &&
+      St.st_size > 0) {
+    void *Map = mmap(NULL, St.st_size, PROT_READ, MAP_PRIVATE, FD, 0);
+    if (Map != MAP_FAILED) {
+      madvise(Map, St.st_size, MADV_SEQUENTIAL);
+      R->Map = (char *)Map;
+      R->Buffer = R->Map;
+      R->End = St.st_size;
+      R->Eof = 1;
+      return R;
+    }
+  }
+  R->Capacity = READ_BUFFER_SIZE;
+  R->Buffer = (char *)malloc(R->Capacity);
+  if (R->Buffer == NULL) {
+    free(R);
     return NULL;
   }
-  CmdCpy->Redirection->File = NULL;
-  if (Cmd->Redirection != NULL) {
-    CmdCpy->Redirection->Mode = Cmd->Redirection->Mode;
-    CmdCpy->Redirection->File =
-        Cmd->Redirection->File == NULL ? NULL : strdup(Cmd->Redirection->File);
+  return R;
+}
+
+int fillLineReader(LineReader *R) {
+  if (R->Start > 0) {
+    memmove(R->Buffer, R->Buffer + R->Start, R->End - R->Start);
+    R->End -= R->Start;
+    R->Start = 0;
   }
-  CmdCpy->TokenCount = Cmd->TokenCount;
-  CmdCpy->Tokens = (char **)calloc(Cmd->TokenCount, sizeof(char *));
-  if (CmdCpy->Tokens == NULL) {
-    freeCommand(CmdCpy);
+  if (R->End == R->Capacity) {
+    char *NewBuffer = (char *)realloc(R->Buffer, R->Capacity * 2);
+    if (NewBuffer == NULL) {
+      perror("realloc");
+      R->Eof = 1;
+      return 0;
+    }
+    R->Buffer = NewBuffer;
+    R->Capacity *= 2;
   }
-  for (int i = 0; i < Cmd->TokenCount; i++) {
-    CmdCpy->Tokens[i] = strdup(Cmd->Tokens[i]);
-    if (CmdCpy->Tokens[i] == NULL) {
-      freeCommand(CmdCpy);
+  size_t Size = R->Shared && !R->Seekable ? 1 : R->Capacity - R->End;
+  ssize_t Count;
+  do
+    Count = read(R->FD, R->Buffer + R->End, Size);
+  while (Count == -1 && errno == EINTR);
+  if (Count <= 0) {
+    if (Count == -1)
+      perror("read");
+    R->Eof = 1;
+    return 0;
+  }
+  R->End += Count;
+  return 1;
+}
+
+int readLine(LineReader *R, const char **Line, size_t *Len) {
+  resumeLineReader(R);
+  size_t Scanned = R->Start;
+  for (;;) {
+    char *NewLine =
+        (char *)memchr(R->Buffer + Scanned, '\n', R->End - Scanned);
+    if (NewLine != NULL) {
+      *Line = R->Buffer + R->Start;
+      *Len = NewLine - *Line;
+      R->Start = NewLine - R->Buffer + 1;
+      return 1;
+    }
+    if (R->Eof) {
+      if (R->Start == R->End)
+        return 0;
+      *Line = R->Buffer + R->Start;
+      *Len = R->End - R->Start;
+      R->Start = R->End;
+      return 1;
     }
+    Scanned = R->End - R->Start;
+    fillLineReader(R);
+    Scanned += R->Start;
   }
-  return CmdCpy;
 }
 
-BuiltinCommandInfo *getBuiltinCommandInfo(Command *Cmd) {
-  if (Cmd == NULL)
-    return NULL;
-  for (int i = 0; i < NumBuiltinCommands; i++)
-    if (strcmp(Cmd->Tokens[0], BuiltinCommandInfoMap[i].Name) == 0)
-      return (BuiltinCommandInfo *)&BuiltinCommandInfoMap[i];
-  return NULL;
+void syncLineReader(LineReader *R) {
+  if (R->Shared && R->Seekable)
+    R->Offset = lseek(R->FD, -(off_t)(R->End - R->Start), SEEK_CUR);
 }
 
-void freeCommand(Command *Cmd) {
-  if (Cmd == NULL)
+void resumeLineReader(LineReader *R) {
+  if (R->Offset == -1)
     return;
-  if (Cmd->Tokens) {
-    for (int i = 0; i < Cmd->TokenCount; i++)
-      if (Cmd->Tokens[i])
-        free(Cmd->Tokens[i]);
-    free(Cmd->Tokens);
-  }
-  if (Cmd->Redirection) {
-    if (Cmd->Redirection->File)
-      free(Cmd->Redirection->File);
-    free(Cmd->Redirection);
-  }
-  free(Cmd);
+  if (lseek(R->FD, 0, SEEK_CUR) != R->Offset)
+    R->Start = R->End = R->Eof = 0;
+  else if (lseek(R->FD, R->End - R->Start, SEEK_CUR) == -1)
+    R->Start = R->End = 0;
+  R->Offset = -1;
 }
 
-void printCommand(Command *Cmd) {
-  if (Cmd == NULL)
+void freeLineReader(LineReader *R) {
+  if (R == NULL)
     return;
-  for (int i = 0; i < Cmd->TokenCount; i++)
-    if (i == Cmd->TokenCount - 1)
-      printf("%s", Cmd->Tokens[i]);
-    else
-      printf("%s ", Cmd->Tokens[i]);
-  printf("\n");
+  if (R->Map != NULL)
+    munmap(R->Map, R->End);
+  else
+    free(R->Buffer);
+  free(R);
 }
 
-LocalVariableArray *initLocalVariables(int Capacity) {
-  LocalVariableArray *VA =
-      (LocalVariableArray *)malloc(sizeof(LocalVariableArray));
-  if (VA == NULL)
+LineEditor *initLineEditor(int FD) {
+  LineEditor *E = (LineEditor *)calloc(1, sizeof(LineEditor));
+  if (E == NULL)
+    return NULL;
+  E->FD = FD;
+  E->Capacity = 256;
+  E->Buffer = (char *)malloc(E->Capacity);
+  if (E->Buffer == NULL || tcgetattr(FD, &E->Original) == -1) {
+    free(E->Buffer);
+    free(E);
     return NULL;
-  VA->Vars = (LocalVariable **)calloc(Capacity, sizeof(LocalVariable *));
-  if (VA->Vars == NULL) {
-    free(VA);
-    fprintf(stderr, "wsh: error initalizing local variables\n");
-    exit(1);
   }
-  VA->Capacity = Capacity;
-  VA->Count = 0;
-  return VA;
+  return E;
 }
 
-void addLocalVariable(LocalVariableArray *VA, LocalVariable *Var) {
-  if (VA == NULL || Var == NULL)
-    return;
-  if (VA->Count >= VA->Capacity) {
-    int NewCapacity = VA->Capacity * 2;
-    LocalVariable **NewVars = (LocalVariable **)realloc(
-        VA->Vars, NewCapacity * sizeof(LocalVariable *));
-    if (NewVars == NULL)
-      return;
-    VA->Vars = NewVars;
-    VA->Capacity = NewCapacity;
+int insertLineEditor(LineEditor *E, const char *Str, size_t Len) {
+  if (E->Len + Len + 1 > E->Capacity) {
+    size_t NewCapacity = (E->Len + Len + 1) * 2;
+    char *NewBuffer = (char *)realloc(E->Buffer, NewCapacity);
+    if (NewBuffer == NULL)
+      return 1;
+    E->Buffer = NewBuffer;
+    E->Capacity = NewCapacity;
   }
-  VA->Vars[VA->Count] = Var;
-  VA->Count++;
+  memcpy(E->Buffer + E->Len, Str, Len);
+  E->Len += Len;
+  E->Buffer[E->Len] = '\0';
+  return 0;
 }
 
-int replaceVariables(Command *Cmd, LocalVariableArray *VA, int CheckFirst) {
-  if (Cmd == NULL || VA == NULL)
-    return 0;
-  for (int i = 0; i < Cmd->TokenCount; i++) {
-    if (Cmd->Tokens[i][0] != '$')
-      continue;
-    if (i == 0 && CheckFirst == 1) {
-      fprintf(stderr, "local: variable cannot start with $\n");
-      return 1;
-    }
-    if (i == 0 && CheckFirst == 2) {
-      fprintf(stderr, "export: variable cannot start with $\n");
-      return 1;
-    }
-    char *Name = Cmd->Tokens[i] + 1;
-    char *Value = getenv(Name);
-    if (Value != NULL) {
-      char *NewValue = strdup(Value);
-      if (NewValue == NULL) {
-        perror("strdup");
-        return 0;
-      }
-      free(Cmd->Tokens[i]);
-      Cmd->Tokens[i] = NewValue;
+void refreshLineEditor(LineEditor *E, Writer *W, const char *Pattern,
+                       const char *Match) {
+  if (Pattern != NULL)
+    writeFormat(W, "\r\033[K(reverse-i-search)`%s': %s", Pattern,
+                Match == NULL ? "" : Match);
+  else
+    writeFormat(W, "\r\033[K%s%.*s", E->Prompt, (int)E->Len, E->Buffer);
+  flushWriter(W);
+}
+
+int searchLineEditor(LineEditor *E, Shell *S) {
+  HistoryIndex *Index = getHistoryIndex(S->Hist);
+  char Pattern[256];
+  size_t PatternLen = 0;
+  int Match = -1;
+  Pattern[0] = '\0';
+  refreshLineEditor(E, S->Out, Pattern, NULL);
+  for (;;) {
+    char C;
+    if (read(E->FD, &C, 1) != 1)
+      return -1;
+    if (C == 0x12 && Index != NULL && PatternLen > 0) {
+      int Older = findHistoryMatch(Index, Pattern, PatternLen,
+                                   Match == -1 ? Index->Count : Match);
+      if (Older != -1)
+        Match = Older;
+    } else if (C == 0x7f || C == 0x08) {
+      if (PatternLen > 0)
+        Pattern[--PatternLen] = '\0';
+      Match = -1;
+      if (Index != NULL && PatternLen > 0)
+        Match = findHistoryMatch(Index, Pattern, PatternLen, Index->Count);
+    } else if (C == 0x07 || C == 0x1b) {
+      refreshLineEditor(E, S->Out, NULL, NULL);
+      return 0;
+    } else if ((unsigned char)C >= ' ' && PatternLen + 1 < sizeof(Pattern)) {
+      Pattern[PatternLen++] = C;
+      Pattern[PatternLen] = '\0';
+      if (Index != NULL)
+        Match = findHistoryMatch(Index, Pattern, PatternLen,
+                                 Match == -1 ? Index->Count : Match + 1);
     } else {
-      LocalVariable *Var = getLocalVariable(Name, VA);
-      free(Cmd->Tokens[i]);
-      if (Var == NULL) {
-        Cmd->Tokens[i] = strdup("");
-        if (Cmd->Tokens[i] == NULL) {
-          perror("strdup");
-          return 0;
-        }
-      } else {
-        char *NewValue = strdup(Var->Value);
-        if (NewValue == NULL) {
-          perror("strdup");
-          return 0;
-        }
-        Cmd->Tokens[i] = NewValue;
+      if (Match != -1) {
+        size_t MatchLen;
+        const char *Text = getHistoryIndexLine(Index, Match, &MatchLen);
+        E->Len = 0;
+        insertLineEditor(E, Text, MatchLen);
       }
+      refreshLineEditor(E, S->Out, NULL, NULL);
+      return C == '\r' || C == '\n';
     }
+    size_t MatchLen;
+    const char *Text =
+        Match == -1 ? NULL : getHistoryIndexLine(Index, Match, &MatchLen);
+    refreshLineEditor(E, S->Out, Pattern, Text);
   }
-  return 0;
 }
 
-void updateLocalVariable(LocalVariableArray *VA, LocalVariable *Var) {
-  for (int i = 0; i < VA->Count; i++) {
-    if (strcmp(VA->Vars[i]->Name, Var->Name) == 0) {
-      free(VA->Vars[i]->Value);
-      VA->Vars[i]->Value = strdup(Var->Value);
-      if (VA->Vars[i]->Value == NULL) {
-        perror("strdup");
+int editLine(LineEditor *E, Shell *S, const char *Prompt, const char **Line,
+             size_t *Len) {
+  struct termios Raw = E->Original;
+  Raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+  Raw.c_cc[VMIN] = 1;
+  Raw.c_cc[VTIME] = 0;
+  tcsetattr(E->FD, TCSADRAIN, &Raw);
+  E->Prompt = Prompt;
+  E->Len = 0;
+  E->Buffer[0] = '\0';
+  int Status = 1;
+  for (;;) {
+    char C;
+    if (read(E->FD, &C, 1) != 1 || (C == 0x04 && E->Len == 0)) {
+      Status = 0;
+      break;
+    }
+    if (C == '\r' || C == '\n')
+      break;
+    if (C == 0x12) {
+      int Accepted = searchLineEditor(E, S);
+      if (Accepted == -1) {
+        Status = 0;
+        break;
       }
-      return;
+      if (Accepted)
+        break;
+    } else if (C == 0x7f || C == 0x08) {
+      if (E->Len > 0)
+        E->Buffer[--E->Len] = '\0';
+      refreshLineEditor(E, S->Out, NULL, NULL);
+    } else if (C == 0x15) {
+      E->Len = 0;
+      refreshLineEditor(E, S->Out, NULL, NULL);
+    } else if (C == 0x1b) {
+      char Seq[2];
+      if (read(E->FD, Seq, 2) == 2 && Seq[0] == '[' && isdigit(Seq[1]))
+        while (read(E->FD, &C, 1) == 1 && isdigit(C))
+          ;
+    } else if ((unsigned char)C >= ' ') {
+      insertLineEditor(E, &C, 1);
+      writeBytes(S->Out, &C, 1);
+      flushWriter(S->Out);
     }
   }
+  writeBytes(S->Out, "\n", 1);
+  flushWriter(S->Out);
+  tcsetattr(E->FD, TCSADRAIN, &E->Original);
+  *Line = E->Buffer;
+  *Len = E->Len;
+  return Status;
 }
 
-LocalVariable *getLocalVariable(const char *Name, LocalVariableArray *VA) {
-  if (Name == NULL || VA == NULL)
-    return NULL;
-  for (int i = 0; i < VA->Count; i++)
-    if (strcmp(Name, VA->Vars[i]->Name) == 0)
-      return VA->Vars[i];
-  return NULL;
+void freeLineEditor(LineEditor *E) {
+  if (E == NULL)
+    return;
+  free(E->Buffer);
+  free(E);
 }
 
-void freeLocalVariableArray(LocalVariableArray *VA) {
-  if (VA == NULL)
-    return;
-  if (VA->Vars) {
-    for (int i = 0; i < VA->Count; i++)
-      freeLocalVariable(VA->Vars[i]);
-    free(VA->Vars);
-  }
-  free(VA);
+unsigned int hashString(const char *Str) {
+  return hashBytes(Str, strlen(Str));
 }
 
-void freeLocalVariable(LocalVariable *Var) {
-  if (Var) {
-    free(Var->Name);
-    free(Var->Value);
-    free(Var);
-  }
+unsigned int hashBytes(const char *Str, size_t Len) {
+  unsigned int Hash = 2166136261u;
+  for (size_t i = 0; i < Len; i++)
+    Hash = (Hash ^ (unsigned char)Str[i]) * 16777619u;
+  return Hash;
 }
 
-History *initHistory(int NumEntries) {
-  History *Hist = (History *)malloc(sizeof(History));
-  if (Hist == NULL)
+ExecutableCache *initExecutableCache(int Capacity) {
+  ExecutableCache *Cache = (ExecutableCache *)malloc(sizeof(ExecutableCache));
+  if (Cache == NULL)
     return NULL;
-  Hist->Entries = (Command **)calloc(NumEntries, sizeof(Command *));
-  if (Hist->Entries == NULL) {
-    free(Hist);
+  Cache->Entries = (ExecutableEntry *)calloc(Capacity, sizeof(ExecutableEntry));
+  if (Cache->Entries == NULL) {
+    free(Cache);
     return NULL;
   }
-  Hist->Count = 0;
-  Hist->Capacity = NumEntries;
-  return Hist;
+  Cache->Count = 0;
+  Cache->Capacity = Capacity;
+  Cache->Relative = 0;
+  Cache->Probes = 0;
+  Cache->Hits = 0;
+  Cache->Misses = 0;
+  return Cache;
 }
 
-int addHistory(History *Hist, Command *Cmd) {
-  Command *PrevCmd = getHistory(1, Hist);
-  if (PrevCmd && compareHistory(Cmd, PrevCmd) == 0) {
-    freeCommand(PrevCmd);
-    return 1;
+ExecutableEntry *getCachedExecutable(const char *Name, unsigned int Hash,
+                                     ExecutableCache *Cache) {
+  int Mask = Cache->Capacity - 1;
+  for (int i = Hash & Mask;; i = (i + 1) & Mask) {
+    ExecutableEntry *Entry = &Cache->Entries[i];
+    if (Entry->Name == NULL)
+      return Entry;
+    if (Entry->Hash == Hash && strcmp(Entry->Name, Name) == 0)
+      return Entry;
   }
-  freeCommand(PrevCmd);
-  if (Hist->Count == Hist->Capacity) {
-    freeCommand(Hist->Entries[0]);
-    for (int i = 0; i < Hist->Capacity - 1; i++) {
-      Hist->Entries[i] = Hist->Entries[i + 1];
+}
+
+ExecutableEntry *addCachedExecutable(const char *Name, const char *Path,
+                                     ExecutableCache *Cache) {
+  if ((Cache->Count + 1) * 4 > Cache->Capacity * 3) {
+    ExecutableCache Grown = {NULL, 0, Cache->Capacity * 2, 0, 0, 0, 0};
+    Grown.Entries =
+        (ExecutableEntry *)calloc(Grown.Capacity, sizeof(ExecutableEntry));
+    if (Grown.Entries == NULL)
+      return NULL;
+    for (int i = 0; i < Cache->Capacity; i++)
+      if (Cache->Entries[i].Name != NULL)
+        *getCachedExecutable(Cache->Entries[i].Name, Cache->Entries[i].Hash,
+                             &Grown) = Cache->Entries[i];
+    free(Cache->Entries);
+    Cache->Entries = Grown.Entries;
+    Cache->Capacity = Grown.Capacity;
+  }
+  unsigned int Hash = hashString(Name);
+  ExecutableEntry *Entry = getCachedExecutable(Name, Hash, Cache);
+  char *NewPath = strdup(Path);
+  if (NewPath == NULL) {
+    perror("strdup");
+    return NULL;
+  }
+  if (Entry->Name == NULL) {
+    Entry->Name = strdup(Name);
+    if (Entry->Name == NULL) {
+      perror("strdup");
+      free(NewPath);
+      return NULL;
     }
-    Hist->Count--;
+    Entry->Hash = Hash;
+    Cache->Count++;
+  } else {
+    free(Entry->Path);
   }
-  Hist->Entries[Hist->Count] = Cmd;
-  Hist->Count++;
-  return 0;
+  Entry->Path = NewPath;
+  Entry->Hits = 0;
+  return Entry;
 }
 
-int compareHistory(Command *CmdA, Command *CmdB) {
-  if (CmdA->TokenCount != CmdB->TokenCount)
-    return 1;
-  for (int i = 0; i < CmdA->TokenCount; i++)
-    if (strcmp(CmdA->Tokens[i], CmdB->Tokens[i]))
-      return 1;
-  return 0;
+void clearExecutableCache(ExecutableCache *Cache) {
+  for (int i = 0; i < Cache->Capacity; i++) {
+    free(Cache->Entries[i].Name);
+    free(Cache->Entries[i].Path);
+  }
+  memset(Cache->Entries, 0, Cache->Capacity * sizeof(ExecutableEntry));
+  Cache->Count = 0;
+  Cache->Relative = 0;
 }
 
-int setHistoryCapacity(int Capacity, History *Hist) {
-  if (Capacity > Hist->Capacity) {
-    Command **NewEntries = realloc(Hist->Entries, Capacity * sizeof(Command *));
-    if (NewEntries == NULL)
-      return 1;
-    Hist->Entries = NewEntries;
-    Hist->Capacity = Capacity;
-  } else {
-    Command **NewEntries = (Command **)calloc(Capacity, sizeof(Command *));
-    if (NewEntries == NULL)
-      return 1;
-    int NumRemoveEntries = Hist->Capacity - Capacity;
-    int Count = Hist->Count < Capacity ? Hist->Count : Capacity;
-    for (int i = 0; i < Count; i++)
-      NewEntries[i] = Hist->Entries[NumRemoveEntries + i];
-    free(Hist->Entries);
-    Hist->Entries = NewEntries;
-    Hist->Capacity = Capacity;
-    Hist->Count = Count;
+void freeExecutableCache(ExecutableCache *Cache) {
+  if (Cache == NULL)
+    return;
+  clearExecutableCache(Cache);
+  free(Cache->Entries);
+  free(Cache);
+}
+
+char *searchPath(const char *Exe, ExecutableCache *Cache) {
+  char ExecutablePath[MAX_PATH_LEN];
+  const char *Dir = getenv("PATH");
+  if (Dir == NULL)
+    return NULL;
+  while (*Dir) {
+    const char *End = strchr(Dir, ':');
+    int DirLen = End == NULL ? (int)strlen(Dir) : (int)(End - Dir);
+    if (DirLen > 0) {
+      snprintf(ExecutablePath, sizeof(ExecutablePath), "%.*s/%s", DirLen, Dir,
+               Exe);
+      Cache->Probes++;
+      if (access(ExecutablePath, X_OK) == 0)
+        return strdup(ExecutablePath);
+    }
+    if (End == NULL)
+      break;
+    Dir = End + 1;
+  }
+  return NULL;
+}
+
+const char *findExecutable(const char *ExeToken, ExecutableCache *Cache) {
+  if (ExeToken == NULL)
+    return NULL;
+  if (strchr(ExeToken, '/') != NULL) {
+    Cache->Probes++;
+    return access(ExeToken, X_OK) == 0 ? ExeToken : NULL;
+  }
+  ExecutableEntry *Entry =
+      getCachedExecutable(ExeToken, hashString(ExeToken), Cache);
+  if (Entry->Name == NULL) {
+    Cache->Misses++;
+    char *Path = searchPath(ExeToken, Cache);
+    if (Path == NULL)
+      return NULL;
+    Entry = addCachedExecutable(ExeToken, Path, Cache);
+    free(Path);
+    if (Entry == NULL)
+      return NULL;
+    if (Entry->Path[0] != '/')
+      Cache->Relative = 1;
+  } else {
+    Cache->Hits++;
+  }
+  Entry->Hits++;
+  return Entry->Path;
+}
+
+int openRedirect(Redirect *R, Writer *Err) {
+  if (R == NULL || R->File == NULL || R->Mode == RedirectNone)
+    return -1;
+  int fd = open(R->File, RedirectFlags[R->Mode].Flags | O_CLOEXEC,
+                RedirectFlags[R->Mode].Mode);
+  if (fd == -1)
+    writeFormat(Err, "%s: no such file or directory\n", R->File);
+  return fd;
+}
+
+int redirect(Redirect *R, SavedFD *Saved, Writer *Err) {
+  FDMove Moves[2];
+  int NumMoves = getRedirectMoves(R, Moves, Err);
+  if (NumMoves <= 0)
+    return NumMoves;
+  int Opened = Moves[0].From;
+  for (int i = 0; i < NumMoves; i++) {
+    Saved[i].FD = Moves[i].To;
+    if (Moves[i].From == Moves[i].To) {
+      Saved[i].Saved = -1;
+      Opened = -1;
+      continue;
+    }
+    Saved[i].Saved = fcntl(Moves[i].To, F_DUPFD_CLOEXEC, SAVED_FD_MIN);
+    if (dup2(Moves[i].From, Moves[i].To) == -1) {
+      perror("dup2");
+      if (Opened != -1)
+        close(Opened);
+      restoreRedirect(Saved, i + 1);
+      return -1;
+    }
+  }
+  if (Opened != -1)
+    close(Opened);
+  return NumMoves;
+}
+
+void restoreRedirect(SavedFD *Saved, int NumSaved) {
+  for (int i = NumSaved - 1; i >= 0; i--) {
+    if (Saved[i].Saved == -1) {
+      close(Saved[i].FD);
+      continue;
+    }
+    dup2(Saved[i].Saved, Saved[i].FD);
+    close(Saved[i].Saved);
+  }
+}
+
+int getRedirectMoves(Redirect *R, FDMove *Moves, Writer *Err) {
+  if (R == NULL || R->File == NULL || R->Mode == RedirectNone)
+    return 0;
+  int fd = openRedirect(R, Err);
+  if (fd == -1)
+    return -1;
+  Moves[0].From = fd;
+  if (R->FD >= 0) {
+    Moves[0].To = R->FD;
+    return 1;
+  }
+  switch (R->Mode) {
+  case RedirectInput:
+    Moves[0].To = STDIN_FILENO;
+    return 1;
+  case RedirectOuputError:
+  case RedirectAppendError:
+    Moves[0].To = STDOUT_FILENO;
+    Moves[1].From = fd;
+    Moves[1].To = STDERR_FILENO;
+    return 2;
+  default:
+    Moves[0].To = STDOUT_FILENO;
+    return 1;
+  }
+}
+
+pid_t spawnProcess(const char *Path, char **Argv, const FDMove *Moves,
+                   int NumMoves) {
+  posix_spawn_file_actions_t Actions;
+  if (posix_spawn_file_actions_init(&Actions) != 0)
+    return forkProcess(Path, Argv, Moves, NumMoves);
+  for (int i = 0; i < NumMoves; i++) {
+    if (posix_spawn_file_actions_adddup2(&Actions, Moves[i].From,
+                                         Moves[i].To) != 0) {
+      posix_spawn_file_actions_destroy(&Actions);
+      return forkProcess(Path, Argv, Moves, NumMoves);
+    }
+  }
+  posix_spawnattr_t Attr;
+  sigset_t Mask;
+  sigemptyset(&Mask);
+  if (posix_spawnattr_init(&Attr) != 0) {
+    posix_spawn_file_actions_destroy(&Actions);
+    return forkProcess(Path, Argv, Moves, NumMoves);
+  }
+  posix_spawnattr_setsigmask(&Attr, &Mask);
+  posix_spawnattr_setflags(&Attr, POSIX_SPAWN_SETSIGMASK);
+  pid_t PID;
+  int Err = posix_spawn(&PID, Path, &Actions, &Attr, Argv, environ);
+  posix_spawnattr_destroy(&Attr);
+  posix_spawn_file_actions_destroy(&Actions);
+  if (Err == 0)
+    return PID;
+  if (Err == ENOSYS || Err == EAGAIN || Err == ENOMEM)
+    return forkProcess(Path, Argv, Moves, NumMoves);
+  errno = Err;
+  return -1;
+}
+
+pid_t forkProcess(const char *Path, char **Argv, const FDMove *Moves,
+                  int NumMoves) {
+  pid_t PID = fork();
+  if (PID != 0)
+    return PID;
+  resetSignalMask();
+  for (int i = 0; i < NumMoves; i++) {
+    if (Moves[i].From == Moves[i].To) {
+      fcntl(Moves[i].To, F_SETFD, 0);
+      continue;
+    }
+    if (dup2(Moves[i].From, Moves[i].To) == -1) {
+      perror("dup2");
+      _exit(1);
+    }
+  }
+  execv(Path, Argv);
+  perror("execv");
+  _exit(1);
+}
+
+void resetSignalMask(void) {
+  sigset_t Mask;
+  sigemptyset(&Mask);
+  sigprocmask(SIG_SETMASK, &Mask, NULL);
+}
+
+Arena *initArena(size_t BlockSize) {
+  Arena *A = (Arena *)malloc(sizeof(Arena));
+  if (A == NULL)
+    return NULL;
+  A->Head = NULL;
+  A->BlockSize = BlockSize;
+  A->NumAllocs = 0;
+  A->Allocated = 0;
+  return A;
+}
+
+void *arenaAlloc(Arena *A, size_t Size) {
+  Size = (Size + 15) & ~(size_t)15;
+  ArenaBlock *Block = A->Head;
+  if (Block == NULL || Block->Size - Block->Used < Size) {
+    size_t BlockSize = Size > A->BlockSize ? Size : A->BlockSize;
+    Block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + BlockSize);
+    if (Block == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    Block->Prev = A->Head;
+    Block->Size = BlockSize;
+    Block->Used = 0;
+    A->Head = Block;
+  }
+  void *Ptr = Block->Data + Block->Used;
+  Block->Used += Size;
+  A->NumAllocs++;
+  A->Allocated += Size;
+  return Ptr;
+}
+
+char *arenaStrndup(Arena *A, const char *Str, size_t Len) {
+  char *Copy = (char *)arenaAlloc(A, Len + 1);
+  memcpy(Copy, Str, Len);
+  Copy[Len] = '\0';
+  return Copy;
+}
+
+ArenaMark getArenaMark(Arena *A) {
+  ArenaMark Mark = {A->Head, A->Head == NULL ? 0 : A->Head->Used};
+  return Mark;
+}
+
+void releaseArena(Arena *A, ArenaMark Mark) {
+  while (A->Head != Mark.Block) {
+    ArenaBlock *Prev = A->Head->Prev;
+    if (Prev == NULL && Mark.Block == NULL && A->Head->Size == A->BlockSize) {
+      A->Head->Used = 0;
+      return;
+    }
+    free(A->Head);
+    A->Head = Prev;
+  }
+  if (A->Head != NULL)
+    A->Head->Used = Mark.Used;
+}
+
+void resetArena(Arena *A) {
+  ArenaMark Mark = {NULL, 0};
+  releaseArena(A, Mark);
+}
+
+void freeArena(Arena *A) {
+  if (A == NULL)
+    return;
+  while (A->Head != NULL) {
+    ArenaBlock *Prev = A->Head->Prev;
+    free(A->Head);
+    A->Head = Prev;
+  }
+  free(A);
+}
+
+int isBlank(char C) { return C == ' ' || C == '\t' || C == '\r' || C == '\n'; }
+
+int isRedirectStart(const char *Line, size_t i, size_t Len) {
+  return Line[i] == '<' || Line[i] == '>' ||
+         (Line[i] == '&' && i + 1 < Len && Line[i + 1] == '>');
+}
+
+size_t scanWord(const char *Line, size_t i, size_t Len) {
+  size_t Op = i;
+  while (Op < Len && isdigit(Line[Op]))
+    Op++;
+  if (Op < Len && isRedirectStart(Line, Op, Len))
+    i = Op + (Line[Op] == '&') + 1;
+  if (i > Op && i < Len && Line[i - 1] == '>' && Line[i] == '>')
+    i++;
+  while (i < Len) {
+    if (isBlank(Line[i]) || Line[i] == '|' || isRedirectStart(Line, i, Len))
+      return i;
+    switch (Line[i]) {
+    case '\\':
+      i = i + 2 < Len ? i + 2 : Len;
+      break;
+    case '\'': {
+      const char *End = memchr(Line + i + 1, '\'', Len - i - 1);
+      if (End == NULL)
+        return (size_t)-1;
+      i = End - Line + 1;
+    } break;
+    case '$':
+      if (i + 1 < Len && (Line[i + 1] == '(' || Line[i + 1] == '{')) {
+        i = findClosingBracket(Line, i + 1, Len);
+        if (i == (size_t)-1)
+          return i;
+      }
+      i++;
+      break;
+    case '"':
+      for (i++; i < Len && Line[i] != '"'; i++)
+        if (Line[i] == '\\')
+          i++;
+      if (i >= Len)
+        return (size_t)-1;
+      i++;
+      break;
+    default:
+      i++;
+    }
   }
+  return i;
+}
+
+RedirectMode getRedirectMode(const char *Word, int *FD) {
+  const char *Op = Word;
+  while (isdigit(*Op))
+    Op++;
+  RedirectMode Mode = RedirectNone;
+  for (int i = RedirectAppendError; i > RedirectNone; i--) {
+    size_t OpLen = strlen(RedirectOps[i]);
+    if (strncmp(Op, RedirectOps[i], OpLen) == 0 &&
+        (Mode == RedirectNone || OpLen > strlen(RedirectOps[Mode])))
+      Mode = (RedirectMode)i;
+  }
+  *FD = Op == Word || Mode == RedirectNone ? -1 : (int)strtol(Word, NULL, 10);
+  return Mode;
+}
+
+int parseRedirect(Command *Cmd, Arena *A, Writer *Err) {
+  int NumTokens = 0;
+  Redirect *R = NULL;
+  for (int i = 0; i < Cmd->TokenCount; i++) {
+    int FD;
+    RedirectMode Mode = getRedirectMode(Cmd->Tokens[i], &FD);
+    if (Mode == RedirectNone) {
+      Cmd->Tokens[NumTokens++] = Cmd->Tokens[i];
+      continue;
+    }
+    char *File = strstr(Cmd->Tokens[i], RedirectOps[Mode]);
+    File += strlen(RedirectOps[Mode]);
+    if (*File == '\0') {
+      int Unused;
+      if (i + 1 == Cmd->TokenCount ||
+          getRedirectMode(Cmd->Tokens[i + 1], &Unused) != RedirectNone) {
+        writeFormat(Err, "wsh: syntax error near '%s'\n", RedirectOps[Mode]);
+        return 1;
+      }
+      File = Cmd->Tokens[++i];
+    }
+    if (R == NULL)
+      R = (Redirect *)arenaAlloc(A, sizeof(Redirect));
+    R->Mode = Mode;
+    R->FD = FD;
+    R->File = File;
+  }
+  if (NumTokens == 0) {
+    writeFormat(Err, "wsh: missing command before redirection\n");
+    return 1;
+  }
+  Cmd->TokenCount = NumTokens;
+  Cmd->Tokens[NumTokens] = NULL;
+  Cmd->Redirection = R;
   return 0;
 }
 
-Command *getHistory(int NumEntry, History *Hist) {
-  if (NumEntry < 1 || NumEntry > Hist->Count)
+Command *parseLine(Shell *S, const char *Line, size_t Len) {
+  unsigned long NumAllocs = S->Arena->NumAllocs;
+  size_t Allocated = S->Arena->Allocated;
+  double Start = startSpan(S);
+  Command *Cmd = getCommand(Line, Len, S->Arena, S->Err);
+  endSpan(S, "parse", Start);
+  S->Stats.Parses++;
+  S->Stats.ParseAllocs += S->Arena->NumAllocs - NumAllocs;
+  S->Stats.ParseBytes += S->Arena->Allocated - Allocated;
+  return Cmd;
+}
+
+Command *getCommand(const char *Input, size_t Len, Arena *A, Writer *Err) {
+  if (Input == NULL || A == NULL)
+    return NULL;
+  while (Len > 0 && isBlank(Input[Len - 1]))
+    Len--;
+  int Background = 0;
+  if (Len > 0 && Input[Len - 1] == '&' && (Len < 2 || Input[Len - 2] != '\\')) {
+    Background = 1;
+    Len--;
+  }
+  char *Line = arenaStrndup(A, Input, Len);
+  int Capacity = INITIAL_WORDS_CAPACITY;
+  char **Words = (char **)arenaAlloc(A, Capacity * sizeof(char *));
+  int NumWords = 0;
+  int NumStages = 0;
+  int StageWords = 0;
+  size_t i = 0;
+  while (i <= Len) {
+    if (i < Len && isBlank(Line[i])) {
+      i++;
+      continue;
+    }
+    if (NumWords + 2 > Capacity) {
+      char **NewWords = (char **)arenaAlloc(A, 2 * Capacity * sizeof(char *));
+      memcpy(NewWords, Words, NumWords * sizeof(char *));
+      Words = NewWords;
+      Capacity *= 2;
+    }
+    int IsPipe = i < Len && Line[i] == '|';
+    if (i < Len && !IsPipe) {
+      size_t End = scanWord(Line, i, Len);
+      if (End == (size_t)-1) {
+        writeFormat(Err, "wsh: unterminated quote\n");
+        return NULL;
+      }
+      StageWords++;
+      if (End < Len && isRedirectStart(Line, End, Len)) {
+        Words[NumWords++] = arenaStrndup(A, Line + i, End - i);
+        i = End;
+        continue;
+      }
+      Words[NumWords++] = Line + i;
+      IsPipe = End < Len && Line[End] == '|';
+      int IsEnd = End == Len;
+      Line[End] = '\0';
+      i = End + 1;
+      if (!IsPipe && !IsEnd)
+        continue;
+    } else {
+      i++;
+    }
+    if (StageWords == 0 && (IsPipe || NumStages > 0)) {
+      writeFormat(Err, "wsh: syntax error near '|'\n");
+      return NULL;
+    }
+    if (StageWords > 0) {
+      Words[NumWords++] = NULL;
+      NumStages++;
+    }
+    StageWords = 0;
+    if (!IsPipe)
+      break;
+  }
+  if (NumStages == 0 || Words[0][0] == '#')
     return NULL;
-  return getCommandCopy(Hist->Entries[Hist->Count - NumEntry]);
+  Command *Head = NULL;
+  Command **Tail = &Head;
+  for (int Start = 0; Start < NumWords;) {
+    Command *Stage = (Command *)arenaAlloc(A, sizeof(Command));
+    Stage->Tokens = Words + Start;
+    Stage->TokenCount = 0;
+    while (Words[Start + Stage->TokenCount] != NULL)
+      Stage->TokenCount++;
+    Start += Stage->TokenCount + 1;
+    Stage->Redirection = NULL;
+    Stage->Background = Head == NULL ? Background : 0;
+    Stage->Timed = 0;
+    if (Head == NULL && Stage->TokenCount > 1 &&
+        strcmp(Stage->Tokens[0], "time") == 0) {
+      Stage->Tokens++;
+      Stage->TokenCount--;
+      Stage->Timed = 1;
+    }
+    Stage->External = 0;
+    if (Stage->TokenCount > 1 && strcmp(Stage->Tokens[0], "command") == 0) {
+      Stage->Tokens++;
+      Stage->TokenCount--;
+      Stage->External = 1;
+    }
+    Stage->Next = NULL;
+    if (parseRedirect(Stage, A, Err))
+      return NULL;
+    *Tail = Stage;
+    Tail = &Stage->Next;
+  }
+  return Head;
 }
 
-void freeHistory(History *Hist) {
-  if (Hist && Hist->Entries) {
-    for (int i = 0; i < Hist->Count; i++)
-      freeCommand(Hist->Entries[i]);
-    free(Hist->Entries);
+BlockKeyword getBlockKeyword(Command *Cmd) {
+  const char *Word = Cmd->Tokens[0];
+  if (strchr("itefwd", Word[0]) == NULL || Cmd->Timed || Cmd->External)
+    return KeywordNone;
+  for (int i = KeywordIf; i <= KeywordDone; i++)
+    if (strcmp(Word, BlockKeywords[i]) == 0)
+      return (BlockKeyword)i;
+  return KeywordNone;
+}
+
+Command *getBlockCondition(Command *Cmd, const char *Terminator, Arena *A,
+                           int *Terminated) {
+  Command *Head = (Command *)arenaAlloc(A, sizeof(Command));
+  *Head = *Cmd;
+  Head->Tokens++;
+  Head->TokenCount--;
+  Command *Last = Head;
+  if (Head->Next != NULL) {
+    for (Last = Head->Next; Last->Next != NULL; Last = Last->Next)
+      ;
+    Command *Copy = (Command *)arenaAlloc(A, sizeof(Command));
+    *Copy = *Last;
+    Command *Prev = Head;
+    while (Prev->Next != Last) {
+      Command *Stage = (Command *)arenaAlloc(A, sizeof(Command));
+      *Stage = *Prev->Next;
+      Prev->Next = Stage;
+      Prev = Stage;
+    }
+    Prev->Next = Copy;
+    Last = Copy;
   }
-  free(Hist);
+  size_t Size = (Last->TokenCount + 1) * sizeof(char *);
+  char **Tokens = (char **)memcpy(arenaAlloc(A, Size), Last->Tokens, Size);
+  Last->Tokens = Tokens;
+  *Terminated = 0;
+  if (Last->TokenCount > 0 && Terminator != NULL &&
+      strcmp(Tokens[Last->TokenCount - 1], Terminator) == 0) {
+    *Terminated = 1;
+    Tokens[--Last->TokenCount] = NULL;
+  }
+  if (Last->TokenCount > 0) {
+    char *Word = Tokens[Last->TokenCount - 1];
+    size_t Len = strlen(Word);
+    if (Len == 1 && Word[0] == ';')
+      Tokens[--Last->TokenCount] = NULL;
+    else if (Len > 1 && Word[Len - 1] == ';' && Word[Len - 2] != '\\')
+      Tokens[Last->TokenCount - 1] = arenaStrndup(A, Word, Len - 1);
+    else if (*Terminated)
+      return NULL;
+  }
+  for (Command *Stage = Head; Stage != NULL; Stage = Stage->Next)
+    if (Stage->TokenCount == 0)
+      return NULL;
+  return Head;
 }
 
-int compareStrs(const void *A, const void *B) {
-  const char *StrA = *(const char **)A;
-  const char *StrB = *(const char **)B;
+BlockParser *initBlockParser(Arena *A) {
+  BlockParser *P = (BlockParser *)arenaAlloc(A, sizeof(BlockParser));
+  P->Root = NULL;
+  P->Depth = 0;
+  P->Capacity = INITIAL_BLOCK_DEPTH;
+  P->Frames = (BlockFrame *)arenaAlloc(A, P->Capacity * sizeof(BlockFrame));
+  return P;
+}
 
-  while (*StrA && *StrB) {
-    if (isalnum(*StrA) && isalnum(*StrB)) {
-      if (*StrA != *StrB) {
-        return *StrA - *StrB;
+Node *addBlockNode(BlockParser *P, NodeKind Kind, Arena *A) {
+  Node *N = (Node *)arenaAlloc(A, sizeof(Node));
+  memset(N, 0, sizeof(Node));
+  N->Kind = Kind;
+  if (P->Depth == 0) {
+    P->Root = N;
+  } else {
+    BlockFrame *F = &P->Frames[P->Depth - 1];
+    *F->Tail = N;
+    F->Tail = &N->Next;
+  }
+  return N;
+}
+
+BlockFrame *pushBlockFrame(BlockParser *P, Node *Block, BlockKeyword Expect,
+                           Arena *A) {
+  if (P->Depth == P->Capacity) {
+    BlockFrame *NewFrames =
+        (BlockFrame *)arenaAlloc(A, 2 * P->Capacity * sizeof(BlockFrame));
+    memcpy(NewFrames, P->Frames, P->Depth * sizeof(BlockFrame));
+    P->Frames = NewFrames;
+    P->Capacity *= 2;
+  }
+  BlockFrame *F = &P->Frames[P->Depth++];
+  F->Block = Block;
+  F->Tail = &Block->Body;
+  F->Expect = Expect;
+  F->InElse = 0;
+  F->Elif = 0;
+  return F;
+}
+
+int addBlockLine(BlockParser *P, Command *Cmd, Arena *A, Writer *Err) {
+  BlockKeyword Keyword = getBlockKeyword(Cmd);
+  BlockFrame *F = P->Depth > 0 ? &P->Frames[P->Depth - 1] : NULL;
+  int IsIf = F != NULL && F->Block->Kind == NodeIf;
+  int Terminated;
+  if (F != NULL && F->Expect != KeywordNone) {
+    if (Keyword != F->Expect || Cmd->TokenCount > 1 || Cmd->Next != NULL)
+      goto SyntaxError;
+    F->Expect = KeywordNone;
+    return 0;
+  }
+  switch (Keyword) {
+  case KeywordIf:
+  case KeywordWhile: {
+    const char *Terminator = Keyword == KeywordIf ? "then" : "do";
+    Command *Cond = getBlockCondition(Cmd, Terminator, A, &Terminated);
+    if (Cond == NULL)
+      goto SyntaxError;
+    Node *N = addBlockNode(P, Keyword == KeywordIf ? NodeIf : NodeWhile, A);
+    N->Cmd = Cond;
+    BlockKeyword Expect = Keyword == KeywordIf ? KeywordThen : KeywordDo;
+    pushBlockFrame(P, N, Terminated ? KeywordNone : Expect, A);
+    return 0;
+  }
+  case KeywordFor: {
+    Command *Words = getBlockCondition(Cmd, "do", A, &Terminated);
+    if (Words == NULL || Words->Next != NULL || Words->Redirection != NULL ||
+        Words->TokenCount < 2 || strcmp(Words->Tokens[1], "in") != 0)
+      goto SyntaxError;
+    Node *N = addBlockNode(P, NodeFor, A);
+    N->Words = Words->Tokens + 1;
+    N->Words[0] = Words->Tokens[0];
+    N->NumWords = Words->TokenCount - 1;
+    pushBlockFrame(P, N, Terminated ? KeywordNone : KeywordDo, A);
+    return 0;
+  }
+  case KeywordElif: {
+    if (!IsIf || F->InElse)
+      goto SyntaxError;
+    Command *Cond = getBlockCondition(Cmd, "then", A, &Terminated);
+    if (Cond == NULL)
+      goto SyntaxError;
+    F->Tail = &F->Block->Else;
+    F->InElse = 1;
+    Node *N = addBlockNode(P, NodeIf, A);
+    N->Cmd = Cond;
+    pushBlockFrame(P, N, Terminated ? KeywordNone : KeywordThen, A)->Elif = 1;
+    return 0;
+  }
+  case KeywordElse:
+    if (!IsIf || F->InElse || Cmd->TokenCount > 1 || Cmd->Next != NULL)
+      goto SyntaxError;
+    F->Tail = &F->Block->Else;
+    F->InElse = 1;
+    return 0;
+  case KeywordFi:
+  case KeywordDone:
+    if (F == NULL || (Keyword == KeywordFi) != IsIf || Cmd->TokenCount > 1 ||
+        Cmd->Next != NULL)
+      goto SyntaxError;
+    while (P->Frames[--P->Depth].Elif)
+      ;
+    return P->Depth == 0;
+  case KeywordThen:
+  case KeywordDo:
+    goto SyntaxError;
+  case KeywordNone:
+    addBlockNode(P, NodeCommand, A)->Cmd = Cmd;
+    return 0;
+  }
+SyntaxError:
+  writeFormat(Err, "wsh: syntax error near '%s'\n", Cmd->Tokens[0]);
+  return -1;
+}
+
+int executeNode(Node *N, Shell *S) {
+  int Status = 0;
+  for (; N != NULL; N = N->Next) {
+    switch (N->Kind) {
+    case NodeCommand:
+      updateJobs(S);
+      flushShellErrors(S);
+      Status = execute(N->Cmd, S);
+      break;
+    case NodeIf:
+      Status = execute(N->Cmd, S) == 0 ? executeNode(N->Body, S)
+                                       : executeNode(N->Else, S);
+      break;
+    case NodeWhile:
+      Status = 0;
+      while (execute(N->Cmd, S) == 0)
+        Status = executeNode(N->Body, S);
+      break;
+    case NodeFor:
+      Status = executeForNode(N, S);
+      break;
+    }
+    S->Error = Status;
+  }
+  return Status;
+}
+
+int isUnquotedExpansion(const char *Word) {
+  if (Word[0] != '$')
+    return 0;
+  size_t Len = strlen(Word);
+  for (size_t i = 0; i < Len; i++) {
+    if (Word[i] == '$' && (Word[i + 1] == '(' || Word[i + 1] == '{')) {
+      if ((i = findClosingBracket(Word, i + 1, Len)) == (size_t)-1)
+        return 0;
+    } else if (Word[i] == '\'' || Word[i] == '"' || Word[i] == '\\') {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int executeForNode(Node *N, Shell *S) {
+  ArenaMark Mark = getArenaMark(S->Arena);
+  int Capacity = N->NumWords;
+  int NumItems = 0;
+  char **Items = (char **)arenaAlloc(S->Arena, Capacity * sizeof(char *));
+  for (int i = 1; i < N->NumWords; i++) {
+    char *Word = N->Words[i];
+    char *Item = expandToken(Word, S);
+    if (Item == NULL) {
+      releaseArena(S->Arena, Mark);
+      return 1;
+    }
+    int Split = isUnquotedExpansion(Word);
+    char *Save;
+    for (char *Field = Split ? strtok_r(Item, " \t\n", &Save) : Item;
+         Field != NULL; Field = Split ? strtok_r(NULL, " \t\n", &Save) : NULL) {
+      if (NumItems == Capacity) {
+        char **NewItems =
+            (char **)arenaAlloc(S->Arena, 2 * Capacity * sizeof(char *));
+        memcpy(NewItems, Items, NumItems * sizeof(char *));
+        Items = NewItems;
+        Capacity *= 2;
       }
-      StrA++;
-      StrB++;
+      Items[NumItems++] = Field;
+    }
+  }
+  const char *Name = N->Words[0];
+  size_t NameLen = strlen(Name);
+  int Status = 0;
+  for (int i = 0; i < NumItems; i++) {
+    if (setLocalVariable(S->VA, Name, NameLen, Items[i])) {
+      Status = 1;
+      break;
+    }
+    Status = executeNode(N->Body, S);
+  }
+  releaseArena(S->Arena, Mark);
+  return Status;
+}
+
+int evaluateArithmetic(const char *Expr, Shell *S, long long *Result) {
+  ArithParser P = {Expr, S, 0, NULL};
+  *Result = parseArithAssignment(&P);
+  skipArithSpace(&P);
+  if (P.Error == NULL && *P.Pos != '\0')
+    P.Error = "syntax error";
+  if (P.Error != NULL) {
+    writeFormat(S->Err, "wsh: arithmetic: %s in '%s'\n", P.Error, Expr);
+    return 1;
+  }
+  return 0;
+}
+
+void skipArithSpace(ArithParser *P) {
+  while (isspace((unsigned char)*P->Pos))
+    P->Pos++;
+}
+
+int isArithName(char C) { return isalnum((unsigned char)C) || C == '_'; }
+
+long long getArithVariable(ArithParser *P, const char *Name, size_t Len) {
+  const char *Value = lookupVariable(Name, Len, P->S->VA);
+  if (Value == NULL || *Value == '\0')
+    return 0;
+  char *End;
+  errno = 0;
+  long long Result = strtoll(Value, &End, 0);
+  while (isspace((unsigned char)*End))
+    End++;
+  if ((*End != '\0' || errno != 0) && P->Error == NULL)
+    P->Error = "invalid number";
+  return Result;
+}
+
+void setArithVariable(ArithParser *P, const char *Name, size_t Len,
+                      long long Value) {
+  if (P->Skip || P->Error != NULL)
+    return;
+  char Digits[24];
+  snprintf(Digits, sizeof(Digits), "%lld", Value);
+  if (setLocalVariable(P->S->VA, Name, Len, Digits))
+    P->Error = "cannot assign";
+}
+
+const ArithOperatorInfo *getArithOperator(const char *Str) {
+  for (int i = 0; i < NumArithOperators; i++) {
+    const ArithOperatorInfo *Info = &ArithOperators[i];
+    size_t Len = strlen(Info->Text);
+    if (strncmp(Str, Info->Text, Len) == 0)
+      return Info->Assignable && Str[Len] == '=' ? NULL : Info;
+  }
+  return NULL;
+}
+
+size_t getArithAssignment(const char *Str, ArithOperator *Op) {
+  *Op = ArithNone;
+  if (Str[0] == '=')
+    return Str[1] == '=' ? 0 : 1;
+  for (int i = 0; i < NumArithOperators; i++) {
+    const ArithOperatorInfo *Info = &ArithOperators[i];
+    size_t Len = strlen(Info->Text);
+    if (Info->Assignable && strncmp(Str, Info->Text, Len) == 0 &&
+        Str[Len] == '=') {
+      *Op = Info->Op;
+      return Len + 1;
+    }
+  }
+  return 0;
+}
+
+long long applyArithOperator(ArithParser *P, ArithOperator Op, long long L,
+                             long long R) {
+  unsigned long long UL = L;
+  unsigned long long UR = R;
+  switch (Op) {
+  case ArithEqual:
+    return L == R;
+  case ArithNotEqual:
+    return L != R;
+  case ArithLessEqual:
+    return L <= R;
+  case ArithGreaterEqual:
+    return L >= R;
+  case ArithShiftLeft:
+    return (long long)(UL << (R & 63));
+  case ArithShiftRight:
+    return L >> (R & 63);
+  case ArithBitOr:
+    return L | R;
+  case ArithBitXor:
+    return L ^ R;
+  case ArithBitAnd:
+    return L & R;
+  case ArithLess:
+    return L < R;
+  case ArithGreater:
+    return L > R;
+  case ArithAdd:
+    return (long long)(UL + UR);
+  case ArithSubtract:
+    return (long long)(UL - UR);
+  case ArithMultiply:
+    return (long long)(UL * UR);
+  case ArithDivide:
+  case ArithModulo:
+    if (R == 0 || (L == LLONG_MIN && R == -1)) {
+      if (!P->Skip && P->Error == NULL)
+        P->Error = R == 0 ? "division by zero" : "overflow";
+      return 0;
+    }
+    return Op == ArithDivide ? L / R : L % R;
+  case ArithNone:
+  case ArithOr:
+  case ArithAnd:
+    break;
+  }
+  return R;
+}
+
+long long parseArithAssignment(ArithParser *P) {
+  skipArithSpace(P);
+  const char *Name = P->Pos;
+  size_t NameLen = getVariableNameLen(Name);
+  if (NameLen > 0) {
+    const char *Op = Name + NameLen;
+    while (isspace((unsigned char)*Op))
+      Op++;
+    ArithOperator BinaryOp;
+    size_t OpLen = getArithAssignment(Op, &BinaryOp);
+    if (OpLen > 0) {
+      P->Pos = Op + OpLen;
+      long long Value = parseArithAssignment(P);
+      if (BinaryOp != ArithNone)
+        Value = applyArithOperator(
+            P, BinaryOp, getArithVariable(P, Name, NameLen), Value);
+      setArithVariable(P, Name, NameLen, Value);
+      return Value;
+    }
+  }
+  return parseArithTernary(P);
+}
+
+long long parseArithTernary(ArithParser *P) {
+  long long Cond = parseArithBinary(P, 1);
+  skipArithSpace(P);
+  if (*P->Pos != '?')
+    return Cond;
+  P->Pos++;
+  int Skip = P->Skip;
+  P->Skip = Skip || !Cond;
+  long long Then = parseArithAssignment(P);
+  skipArithSpace(P);
+  if (*P->Pos != ':') {
+    if (P->Error == NULL)
+      P->Error = "expected ':'";
+    P->Skip = Skip;
+    return 0;
+  }
+  P->Pos++;
+  P->Skip = Skip || Cond;
+  long long Else = parseArithTernary(P);
+  P->Skip = Skip;
+  return Cond ? Then : Else;
+}
+
+long long parseArithBinary(ArithParser *P, int MinPrec) {
+  long long L = parseArithUnary(P);
+  for (;;) {
+    skipArithSpace(P);
+    const ArithOperatorInfo *Info = getArithOperator(P->Pos);
+    if (Info == NULL || Info->Prec < MinPrec || P->Error != NULL)
+      return L;
+    P->Pos += strlen(Info->Text);
+    if (Info->Op == ArithOr || Info->Op == ArithAnd) {
+      int Skip = P->Skip;
+      P->Skip = Skip || (Info->Op == ArithOr ? L != 0 : L == 0);
+      long long R = parseArithBinary(P, Info->Prec + 1);
+      P->Skip = Skip;
+      L = Info->Op == ArithOr ? (L != 0 || R != 0) : (L != 0 && R != 0);
     } else {
-      if (!isalnum(*StrA))
-        StrA++;
-      if (!isalnum(*StrB))
-        StrB++;
+      L = applyArithOperator(P, Info->Op, L,
+                             parseArithBinary(P, Info->Prec + 1));
+    }
+  }
+}
+
+long long parseArithUnary(ArithParser *P) {
+  skipArithSpace(P);
+  char C = *P->Pos;
+  if (P->Error != NULL)
+    return 0;
+  if (C == '+' || C == '-' || C == '!' || C == '~') {
+    P->Pos++;
+    unsigned long long Value = parseArithUnary(P);
+    return C == '-' ? (long long)(0 - Value)
+           : C == '!' ? !Value
+           : C == '~' ? (long long)~Value
+                      : (long long)Value;
+  }
+  if (C == '$' && P->Pos[1] != '(')
+    C = *++P->Pos;
+  if (C == '$')
+    C = *++P->Pos;
+  if (C == '(') {
+    P->Pos++;
+    long long Value = parseArithAssignment(P);
+    skipArithSpace(P);
+    if (*P->Pos != ')') {
+      if (P->Error == NULL)
+        P->Error = "expected ')'";
+      return 0;
+    }
+    P->Pos++;
+    return Value;
+  }
+  if (isdigit((unsigned char)C)) {
+    char *End;
+    errno = 0;
+    long long Value = strtoll(P->Pos, &End, 0);
+    if (errno != 0 || isArithName(*End))
+      P->Error = "invalid number";
+    P->Pos = End;
+    return Value;
+  }
+  size_t Len = getVariableNameLen(P->Pos);
+  if (Len == 0) {
+    P->Error = "syntax error";
+    return 0;
+  }
+  P->Pos += Len;
+  return getArithVariable(P, P->Pos - Len, Len);
+}
+
+char *getCommandLine(Command *Cmd, Arena *A, size_t *Len) {
+  size_t Size = 3;
+  for (Command *Stage = Cmd; Stage != NULL; Stage = Stage->Next) {
+    Size += 11;
+    for (int i = 0; i < Stage->TokenCount; i++)
+      Size += strlen(Stage->Tokens[i]) + 1;
+    if (Stage->Redirection != NULL)
+      Size += strlen(Stage->Redirection->File) + 16;
+  }
+  char *Line = (char *)arenaAlloc(A, Size + 5);
+  char *Out = Line;
+  if (Cmd->Timed)
+    Out = stpcpy(Out, "time ");
+  for (Command *Stage = Cmd; Stage != NULL; Stage = Stage->Next) {
+    if (Stage != Cmd)
+      Out = stpcpy(Out, " | ");
+    if (Stage->External)
+      Out = stpcpy(Out, "command ");
+    for (int i = 0; i < Stage->TokenCount; i++) {
+      if (i > 0)
+        *Out++ = ' ';
+      Out = stpcpy(Out, Stage->Tokens[i]);
+    }
+    Redirect *R = Stage->Redirection;
+    if (R != NULL) {
+      *Out++ = ' ';
+      if (R->FD >= 0)
+        Out += sprintf(Out, "%d", R->FD);
+      Out = stpcpy(stpcpy(Out, RedirectOps[R->Mode]), R->File);
+    }
+  }
+  if (Cmd->Background)
+    Out = stpcpy(Out, " &");
+  *Len = Out - Line;
+  return Line;
+}
+
+BuiltinCommandInfo *getBuiltinCommandInfo(Command *Cmd) {
+  if (Cmd == NULL || Cmd->External)
+    return NULL;
+  for (int i = 0; i < NumBuiltinCommands; i++)
+    if (strcmp(Cmd->Tokens[0], BuiltinCommandInfoMap[i].Name) == 0)
+      return (BuiltinCommandInfo *)&BuiltinCommandInfoMap[i];
+  return NULL;
+}
+
+LocalVariableArray *initLocalVariables(int Capacity) {
+  LocalVariableArray *VA =
+      (LocalVariableArray *)malloc(sizeof(LocalVariableArray));
+  if (VA == NULL)
+    return NULL;
+  VA->Vars = (LocalVariable **)calloc(Capacity, sizeof(LocalVariable *));
+  VA->TableCapacity = Capacity * 2;
+  VA->Table =
+      (LocalVariable **)calloc(VA->TableCapacity, sizeof(LocalVariable *));
+  if (VA->Vars == NULL || VA->Table == NULL) {
+    free(VA->Vars);
+    free(VA->Table);
+    free(VA);
+    fprintf(stderr, "wsh: error initalizing local variables\n");
+    exit(1);
+  }
+  VA->Capacity = Capacity;
+  VA->Count = 0;
+  VA->NumEntries = 0;
+  VA->Lookups = 0;
+  for (char **Env = environ; *Env != NULL; Env++) {
+    char *Value = strchr(*Env, '=');
+    if (Value == NULL)
+      continue;
+    LocalVariable *Var = addLocalVariable(VA, *Env, Value - *Env);
+    if (Var != NULL)
+      Var->EnvValue = Value + 1;
+  }
+  return VA;
+}
+
+LocalVariable **findLocalVariable(const char *Name, size_t Len,
+                                  unsigned int Hash, LocalVariableArray *VA) {
+  int Mask = VA->TableCapacity - 1;
+  for (int i = Hash & Mask;; i = (i + 1) & Mask) {
+    LocalVariable *Var = VA->Table[i];
+    if (Var == NULL)
+      return &VA->Table[i];
+    if (Var->Hash == Hash && strncmp(Var->Name, Name, Len) == 0 &&
+        Var->Name[Len] == '\0')
+      return &VA->Table[i];
+  }
+}
+
+LocalVariable *addLocalVariable(LocalVariableArray *VA, const char *Name,
+                                size_t Len) {
+  if ((VA->NumEntries + 1) * 2 > VA->TableCapacity) {
+    int NewCapacity = VA->TableCapacity * 2;
+    LocalVariable **NewTable =
+        (LocalVariable **)calloc(NewCapacity, sizeof(LocalVariable *));
+    if (NewTable == NULL)
+      return NULL;
+    for (int i = 0; i < VA->TableCapacity; i++) {
+      LocalVariable *Var = VA->Table[i];
+      if (Var == NULL)
+        continue;
+      int j = Var->Hash & (NewCapacity - 1);
+      while (NewTable[j] != NULL)
+        j = (j + 1) & (NewCapacity - 1);
+      NewTable[j] = Var;
+    }
+    free(VA->Table);
+    VA->Table = NewTable;
+    VA->TableCapacity = NewCapacity;
+  }
+  unsigned int Hash = hashBytes(Name, Len);
+  LocalVariable **Slot = findLocalVariable(Name, Len, Hash, VA);
+  if (*Slot != NULL)
+    return *Slot;
+  LocalVariable *Var = (LocalVariable *)malloc(sizeof(LocalVariable) + Len + 1);
+  if (Var == NULL)
+    return NULL;
+  Var->Name = (char *)(Var + 1);
+  memcpy(Var->Name, Name, Len);
+  Var->Name[Len] = '\0';
+  Var->Value = NULL;
+  Var->ValueSize = 0;
+  Var->EnvValue = NULL;
+  Var->Hash = Hash;
+  *Slot = Var;
+  VA->NumEntries++;
+  return Var;
+}
+
+int setLocalVariable(LocalVariableArray *VA, const char *Name, size_t Len,
+                     const char *Value) {
+  LocalVariable *Var = addLocalVariable(VA, Name, Len);
+  if (Var == NULL)
+    return 1;
+  size_t ValueLen = strlen(Value);
+  if (Var->Value == NULL) {
+    if (VA->Count >= VA->Capacity) {
+      int NewCapacity = VA->Capacity * 2;
+      LocalVariable **NewVars = (LocalVariable **)realloc(
+          VA->Vars, NewCapacity * sizeof(LocalVariable *));
+      if (NewVars == NULL)
+        return 1;
+      VA->Vars = NewVars;
+      VA->Capacity = NewCapacity;
+    }
+    VA->Vars[VA->Count++] = Var;
+  }
+  if (Var->ValueSize <= ValueLen) {
+    size_t NewSize = ValueLen < 16 ? 16 : ValueLen + 1;
+    char *NewValue = (char *)realloc(Var->Value, NewSize);
+    if (NewValue == NULL) {
+      perror("realloc");
+      return 1;
+    }
+    Var->Value = NewValue;
+    Var->ValueSize = NewSize;
+  }
+  memcpy(Var->Value, Value, ValueLen + 1);
+  return 0;
+}
+
+int setEnvironmentVariable(LocalVariableArray *VA, const char *Name,
+                           const char *Value) {
+  if (setenv(Name, Value, 1) < 0)
+    return 1;
+  LocalVariable *Var = addLocalVariable(VA, Name, strlen(Name));
+  if (Var == NULL)
+    return 1;
+  Var->EnvValue = getenv(Name);
+  return 0;
+}
+
+const char *getVariable(const char *Name, LocalVariableArray *VA) {
+  return lookupVariable(Name, strlen(Name), VA);
+}
+
+const char *lookupVariable(const char *Name, size_t Len,
+                           LocalVariableArray *VA) {
+  VA->Lookups++;
+  LocalVariable *Var = *findLocalVariable(Name, Len, hashBytes(Name, Len), VA);
+  if (Var == NULL)
+    return NULL;
+  return Var->EnvValue != NULL ? Var->EnvValue : Var->Value;
+}
+
+void initStringBuilder(StringBuilder *B, Arena *A, size_t Capacity) {
+  B->A = A;
+  B->Data = (char *)arenaAlloc(A, Capacity + 1);
+  B->Data[0] = '\0';
+  B->Len = 0;
+  B->Capacity = Capacity;
+}
+
+void appendString(StringBuilder *B, const char *Str, size_t Len) {
+  if (B->Len + Len > B->Capacity) {
+    size_t NewCapacity = B->Capacity * 2 + Len;
+    char *NewData = (char *)arenaAlloc(B->A, NewCapacity + 1);
+    memcpy(NewData, B->Data, B->Len);
+    B->Data = NewData;
+    B->Capacity = NewCapacity;
+  }
+  memcpy(B->Data + B->Len, Str, Len);
+  B->Len += Len;
+  B->Data[B->Len] = '\0';
+}
+
+size_t findClosingBracket(const char *Line, size_t i, size_t Len) {
+  char Open = Line[i];
+  char Close = Open == '(' ? ')' : '}';
+  int Depth = 0;
+  for (; i < Len; i++) {
+    if (Line[i] == Open) {
+      Depth++;
+    } else if (Line[i] == Close) {
+      if (--Depth == 0)
+        return i;
+    }
+    switch (Line[i]) {
+    case '\\':
+      i++;
+      break;
+    case '\'': {
+      const char *End = memchr(Line + i + 1, '\'', Len - i - 1);
+      if (End == NULL)
+        return (size_t)-1;
+      i = End - Line;
+    } break;
+    case '"':
+      for (i++; i < Len && Line[i] != '"'; i++)
+        if (Line[i] == '\\')
+          i++;
+      break;
+    }
+  }
+  return (size_t)-1;
+}
+
+int expandArithmetic(StringBuilder *B, const char *Expr, size_t Len,
+                     Shell *S) {
+  char *Text = arenaStrndup(S->Arena, Expr, Len);
+  if (memchr(Text, '$', Len) != NULL) {
+    StringBuilder Expanded;
+    initStringBuilder(&Expanded, S->Arena, Len);
+    if (expandWord(&Expanded, Text, S))
+      return 1;
+    Text = Expanded.Data;
+  }
+  long long Value;
+  if (evaluateArithmetic(Text, S, &Value))
+    return 1;
+  char Digits[24];
+  appendString(B, Digits, snprintf(Digits, sizeof(Digits), "%lld", Value));
+  return 0;
+}
+
+size_t getVariableNameLen(const char *Str) {
+  if (!isalpha((unsigned char)*Str) && *Str != '_')
+    return 0;
+  size_t Len = 1;
+  while (isalnum((unsigned char)Str[Len]) || Str[Len] == '_')
+    Len++;
+  return Len;
+}
+
+int expandParameter(StringBuilder *B, const char *Param, size_t Len,
+                    Shell *S) {
+  size_t NameLen = getVariableNameLen(Param);
+  if (NameLen == 0 && Param[0] == '?')
+    NameLen = 1;
+  if (NameLen == 0 || NameLen > Len) {
+    writeFormat(S->Err, "wsh: bad substitution: ${%.*s}\n", (int)Len, Param);
+    return 1;
+  }
+  char Status[12];
+  const char *Value = Status;
+  if (Param[0] == '?')
+    snprintf(Status, sizeof(Status), "%d", S->Error);
+  else
+    Value = lookupVariable(Param, NameLen, S->VA);
+  if (NameLen == Len) {
+    if (Value != NULL)
+      appendString(B, Value, strlen(Value));
+    return 0;
+  }
+  const char *Op = Param + NameLen;
+  int Colon = *Op == ':';
+  Op += Colon;
+  if (strchr("-=+", *Op) == NULL || *Op == '\0') {
+    writeFormat(S->Err, "wsh: bad substitution: ${%.*s}\n", (int)Len, Param);
+    return 1;
+  }
+  int IsSet = Value != NULL && (!Colon || *Value != '\0');
+  if ((*Op == '+') != IsSet) {
+    if (Value != NULL)
+      appendString(B, Value, strlen(Value));
+    return 0;
+  }
+  const char *Word = arenaStrndup(S->Arena, Op + 1, Param + Len - Op - 1);
+  size_t Start = B->Len;
+  if (expandWord(B, Word, S))
+    return 1;
+  if (*Op == '=' && Param[0] != '?' &&
+      setLocalVariable(S->VA, Param, NameLen, B->Data + Start))
+    return 1;
+  return 0;
+}
+
+int expandCommand(StringBuilder *B, const char *Text, size_t Len, Shell *S) {
+  Command *Cmd = getCommand(Text, Len, S->Arena, S->Err);
+  if (Cmd == NULL)
+    return 0;
+  CaptureBuffer Buf = {-1, NULL, 0, 0};
+  int Status;
+  if (isReadOnlyCommand(Cmd))
+    Status = captureBuiltin(Cmd, S, &Buf);
+  else
+    Status = captureCommand(Cmd, S, &Buf);
+  S->Error = S->SubstitutionStatus = Status;
+  S->Substitutions++;
+  while (Buf.Len > 0 && Buf.Data[Buf.Len - 1] == '\n')
+    Buf.Len--;
+  appendString(B, Buf.Data, Buf.Len);
+  free(Buf.Data);
+  return 0;
+}
+
+int isReadOnlyCommand(Command *Cmd) {
+  BuiltinCommandInfo *BC = getBuiltinCommandInfo(Cmd);
+  return BC != NULL && Cmd->Next == NULL && Cmd->Redirection == NULL &&
+         !Cmd->Background &&
+         (BC->Effect == BuiltinReadOnly || BC->Effect == BuiltinReadsInput ||
+          (BC->Effect == BuiltinReadOnlyBare && Cmd->TokenCount == 1));
+}
+
+int captureBuiltin(Command *Cmd, Shell *S, CaptureBuffer *Buf) {
+  Writer *Capture = initWriter(-1, SUBSTITUTION_BUFFER_SIZE);
+  if (Capture == NULL)
+    return 1;
+  Writer *Out = S->Out;
+  S->Out = Capture;
+  int Status = execute(Cmd, S);
+  S->Out = Out;
+  Buf->Data = Capture->Data;
+  Buf->Len = Capture->Len;
+  Buf->Capacity = Capture->Capacity;
+  free(Capture);
+  return Status;
+}
+
+int captureCommand(Command *Cmd, Shell *S, CaptureBuffer *Buf) {
+  int NumStages = 0;
+  for (Command *Stage = Cmd; Stage != NULL; Stage = Stage->Next)
+    NumStages++;
+  Buf->Data = (char *)malloc(SUBSTITUTION_BUFFER_SIZE);
+  Job *J = initJob(NumStages, "", 0);
+  if (Buf->Data == NULL || J == NULL) {
+    perror("malloc");
+    freeJob(J);
+    return 1;
+  }
+  Buf->Capacity = SUBSTITUTION_BUFFER_SIZE;
+  int Pipe[2];
+  if (pipe2(Pipe, O_CLOEXEC) == -1) {
+    perror("pipe");
+    freeJob(J);
+    return 1;
+  }
+  flushShellOutput(S);
+  launchJob(J, Cmd, S, -1, Pipe[1], -1);
+  close(Pipe[1]);
+  for (;;) {
+    if (Buf->Len == Buf->Capacity && growCapture(Buf, Buf->Capacity * 2))
+      break;
+    ssize_t N = read(Pipe[0], Buf->Data + Buf->Len, Buf->Capacity - Buf->Len);
+    if (N > 0)
+      Buf->Len += N;
+    else if (N == 0 || errno != EINTR)
+      break;
+  }
+  close(Pipe[0]);
+  int Status = waitJob(J, S->Jobs);
+  freeJob(J);
+  return Status;
+}
+
+int expandDollar(StringBuilder *B, const char **In, Shell *S) {
+  const char *Dollar = *In;
+  if (Dollar[1] == '(' || Dollar[1] == '{') {
+    size_t End = findClosingBracket(Dollar, 1, strlen(Dollar));
+    int Arithmetic = Dollar[1] == '(' && Dollar[2] == '(' &&
+                     End != (size_t)-1 && Dollar[End - 1] == ')';
+    if (End == (size_t)-1) {
+      writeFormat(S->Err, "wsh: bad substitution: %s\n", Dollar);
+      return 1;
+    }
+    *In = Dollar + End + 1;
+    if (Arithmetic)
+      return expandArithmetic(B, Dollar + 3, End - 4, S);
+    if (Dollar[1] == '(')
+      return expandCommand(B, Dollar + 2, End - 2, S);
+    return expandParameter(B, Dollar + 2, End - 2, S);
+  }
+  size_t NameLen = getVariableNameLen(Dollar + 1);
+  if (NameLen == 0 && Dollar[1] == '?') {
+    char Status[12];
+    appendString(B, Status, snprintf(Status, sizeof(Status), "%d", S->Error));
+    *In = Dollar + 2;
+    return 0;
+  }
+  if (NameLen == 0) {
+    appendString(B, Dollar, 1);
+    *In = Dollar + 1;
+    return 0;
+  }
+  const char *Value = lookupVariable(Dollar + 1, NameLen, S->VA);
+  if (Value != NULL)
+    appendString(B, Value, strlen(Value));
+  *In = Dollar + 1 + NameLen;
+  return 0;
+}
+
+int expandWord(StringBuilder *B, const char *Token, Shell *S) {
+  const char *In = Token;
+  char Quote = '\0';
+  while (*In != '\0') {
+    if (Quote == '\'') {
+      const char *End = strchrnul(In, '\'');
+      appendString(B, In, End - In);
+      In = *End == '\0' ? End : End + 1;
+      Quote = '\0';
+      continue;
+    }
+    const char *Run = In;
+    while (*In != '\0' && *In != '$' && *In != '"' && *In != '\\' &&
+           (*In != '\'' || Quote == '"'))
+      In++;
+    if (In != Run)
+      appendString(B, Run, In - Run);
+    switch (*In) {
+    case '\'':
+      Quote = '\'';
+      In++;
+      break;
+    case '"':
+      Quote = Quote == '"' ? '\0' : '"';
+      In++;
+      break;
+    case '\\':
+      if (In[1] != '\0' &&
+          (Quote == '\0' || strchr("\"\\$`", In[1]) != NULL))
+        In++;
+      appendString(B, In++, 1);
+      break;
+    case '$':
+      if (expandDollar(B, &In, S))
+        return 1;
+      break;
+    }
+  }
+  return 0;
+}
+
+int needsExpansion(const char *Token) {
+  for (; *Token != '\0'; Token++)
+    if (*Token == '$' || *Token == '"' || *Token == '\'' || *Token == '\\')
+      return 1;
+  return 0;
+}
+
+char *expandTokenInto(StringBuilder *B, char *Token, Shell *S) {
+  if (!needsExpansion(Token))
+    return Token;
+  size_t Start = B->Len;
+  if (expandWord(B, Token, S))
+    return NULL;
+  appendString(B, "", 1);
+  return B->Data + Start;
+}
+
+char *expandToken(char *Token, Shell *S) {
+  if (!needsExpansion(Token))
+    return Token;
+  StringBuilder B;
+  initStringBuilder(&B, S->Arena, strlen(Token));
+  return expandTokenInto(&B, Token, S);
+}
+
+Command *replaceVariables(Command *Cmd, Shell *S, int CheckFirst) {
+  if (Cmd == NULL || S == NULL)
+    return NULL;
+  if (Cmd->Tokens[0][0] == '$' && CheckFirst == 1) {
+    writeFormat(S->Err, "local: variable cannot start with $\n");
+    return NULL;
+  }
+  if (Cmd->Tokens[0][0] == '$' && CheckFirst == 2) {
+    writeFormat(S->Err, "export: variable cannot start with $\n");
+    return NULL;
+  }
+  Command *Expanded = (Command *)arenaAlloc(S->Arena, sizeof(Command));
+  int Capacity = Cmd->TokenCount + 1;
+  int NumTokens = 0;
+  Expanded->Tokens = (char **)arenaAlloc(S->Arena, Capacity * sizeof(char *));
+  StringBuilder B = {NULL, NULL, 0, 0};
+  for (int i = 0; i < Cmd->TokenCount; i++) {
+    if (B.Data == NULL && needsExpansion(Cmd->Tokens[i]))
+      initStringBuilder(&B, S->Arena, EXPANSION_BUFFER_SIZE);
+    unsigned long Substitutions = S->Substitutions;
+    char *Token = expandTokenInto(&B, Cmd->Tokens[i], S);
+    if (Token == NULL)
+      return NULL;
+    int Split = S->Substitutions != Substitutions &&
+                isUnquotedExpansion(Cmd->Tokens[i]);
+    char *Save;
+    for (char *Field = Split ? strtok_r(Token, " \t\n", &Save) : Token;
+         Field != NULL; Field = Split ? strtok_r(NULL, " \t\n", &Save) : NULL) {
+      if (NumTokens + 1 == Capacity) {
+        char **NewTokens =
+            (char **)arenaAlloc(S->Arena, 2 * Capacity * sizeof(char *));
+        memcpy(NewTokens, Expanded->Tokens, NumTokens * sizeof(char *));
+        Expanded->Tokens = NewTokens;
+        Capacity *= 2;
+      }
+      Expanded->Tokens[NumTokens++] = Field;
+    }
+  }
+  if (NumTokens == 0)
+    Expanded->Tokens[NumTokens++] = "";
+  Expanded->Tokens[NumTokens] = NULL;
+  Expanded->TokenCount = NumTokens;
+  Expanded->Redirection = NULL;
+  if (Cmd->Redirection != NULL) {
+    Expanded->Redirection = (Redirect *)arenaAlloc(S->Arena, sizeof(Redirect));
+    *Expanded->Redirection = *Cmd->Redirection;
+    Expanded->Redirection->File =
+        B.Data != NULL ? expandTokenInto(&B, Cmd->Redirection->File, S)
+                       : expandToken(Cmd->Redirection->File, S);
+    if (Expanded->Redirection->File == NULL)
+      return NULL;
+  }
+  Expanded->Background = Cmd->Background;
+  Expanded->Timed = Cmd->Timed;
+  Expanded->External = Cmd->External;
+  Expanded->Next = NULL;
+  return Expanded;
+}
+
+LocalVariable *getLocalVariable(const char *Name, LocalVariableArray *VA) {
+  if (Name == NULL || VA == NULL)
+    return NULL;
+  size_t Len = strlen(Name);
+  return *findLocalVariable(Name, Len, hashBytes(Name, Len), VA);
+}
+
+void freeLocalVariableArray(LocalVariableArray *VA) {
+  if (VA == NULL)
+    return;
+  if (VA->Table) {
+    for (int i = 0; i < VA->TableCapacity; i++)
+      freeLocalVariable(VA->Table[i]);
+    free(VA->Table);
+  }
+  free(VA->Vars);
+  free(VA);
+}
+
+void freeLocalVariable(LocalVariable *Var) {
+  if (Var) {
+    free(Var->Value);
+    free(Var);
+  }
+}
+
+History *initHistory(int NumEntries) {
+  History *Hist = (History *)malloc(sizeof(History));
+  if (Hist == NULL)
+    return NULL;
+  Hist->Entries = (HistoryEntry **)calloc(NumEntries, sizeof(HistoryEntry *));
+  Hist->Pool = (HistoryEntry **)calloc(INITIAL_HISTORY_POOL_CAPACITY,
+                                       sizeof(HistoryEntry *));
+  if (Hist->Entries == NULL || Hist->Pool == NULL) {
+    free(Hist->Entries);
+    free(Hist->Pool);
+    free(Hist);
+    return NULL;
+  }
+  Hist->Head = 0;
+  Hist->Count = 0;
+  Hist->Capacity = NumEntries;
+  Hist->FD = -1;
+  Hist->Index = NULL;
+  Hist->IndexOwner = 0;
+  Hist->IndexedSize = 0;
+  Hist->PoolCount = 0;
+  Hist->PoolCapacity = INITIAL_HISTORY_POOL_CAPACITY;
+  return Hist;
+}
+
+HistoryEntry **findHistoryEntry(const char *Line, size_t Len, unsigned int Hash,
+                                History *Hist) {
+  int Mask = Hist->PoolCapacity - 1;
+  for (int i = Hash & Mask;; i = (i + 1) & Mask) {
+    HistoryEntry *Entry = Hist->Pool[i];
+    if (Entry == NULL)
+      return &Hist->Pool[i];
+    if (Entry->Hash == Hash && Entry->Len == Len &&
+        memcmp(Entry->Text, Line, Len) == 0)
+      return &Hist->Pool[i];
+  }
+}
+
+HistoryEntry *internHistoryEntry(const char *Line, size_t Len, History *Hist) {
+  if ((Hist->PoolCount + 1) * 2 > Hist->PoolCapacity) {
+    int NewCapacity = Hist->PoolCapacity * 2;
+    HistoryEntry **NewPool =
+        (HistoryEntry **)calloc(NewCapacity, sizeof(HistoryEntry *));
+    if (NewPool == NULL)
+      return NULL;
+    for (int i = 0; i < Hist->PoolCapacity; i++) {
+      HistoryEntry *Entry = Hist->Pool[i];
+      if (Entry == NULL)
+        continue;
+      int j = Entry->Hash & (NewCapacity - 1);
+      while (NewPool[j] != NULL)
+        j = (j + 1) & (NewCapacity - 1);
+      NewPool[j] = Entry;
+    }
+    free(Hist->Pool);
+    Hist->Pool = NewPool;
+    Hist->PoolCapacity = NewCapacity;
+  }
+  unsigned int Hash = hashBytes(Line, Len);
+  HistoryEntry **Slot = findHistoryEntry(Line, Len, Hash, Hist);
+  if (*Slot != NULL) {
+    (*Slot)->RefCount++;
+    return *Slot;
+  }
+  HistoryEntry *Entry = (HistoryEntry *)malloc(sizeof(HistoryEntry) + Len + 1);
+  if (Entry == NULL)
+    return NULL;
+  Entry->RefCount = 1;
+  Entry->Hash = Hash;
+  Entry->Len = Len;
+  memcpy(Entry->Text, Line, Len);
+  Entry->Text[Len] = '\0';
+  *Slot = Entry;
+  Hist->PoolCount++;
+  return Entry;
+}
+
+void releaseHistoryEntry(HistoryEntry *Entry, History *Hist) {
+  if (--Entry->RefCount > 0)
+    return;
+  int Mask = Hist->PoolCapacity - 1;
+  int i = findHistoryEntry(Entry->Text, Entry->Len, Entry->Hash, Hist) -
+          Hist->Pool;
+  for (int j = (i + 1) & Mask; Hist->Pool[j] != NULL; j = (j + 1) & Mask) {
+    int Home = Hist->Pool[j]->Hash & Mask;
+    if (i <= j ? (i < Home && Home <= j) : (i < Home || Home <= j))
+      continue;
+    Hist->Pool[i] = Hist->Pool[j];
+    i = j;
+  }
+  Hist->Pool[i] = NULL;
+  Hist->PoolCount--;
+  free(Entry);
+}
+
+int pushHistory(History *Hist, const char *Line, size_t Len) {
+  if (Hist->Count > 0) {
+    HistoryEntry *Prev =
+        Hist->Entries[(Hist->Head + Hist->Count - 1) % Hist->Capacity];
+    if (Prev->Len == Len && memcmp(Prev->Text, Line, Len) == 0)
+      return 1;
+  }
+  HistoryEntry *Entry = internHistoryEntry(Line, Len, Hist);
+  if (Entry == NULL)
+    return 1;
+  if (Hist->Count == Hist->Capacity) {
+    releaseHistoryEntry(Hist->Entries[Hist->Head], Hist);
+    Hist->Entries[Hist->Head] = Entry;
+    Hist->Head = (Hist->Head + 1) % Hist->Capacity;
+  } else {
+    Hist->Entries[(Hist->Head + Hist->Count) % Hist->Capacity] = Entry;
+    Hist->Count++;
+  }
+  return 0;
+}
+
+int addHistory(History *Hist, const char *Line, size_t Len) {
+  if (pushHistory(Hist, Line, Len))
+    return 1;
+  if (Hist->Index != NULL)
+    addHistoryIndexLine(Hist->Index, Line, Len);
+  if (Hist->FD == -1)
+    return 0;
+  struct iovec Parts[2] = {{(void *)Line, Len}, {"\n", 1}};
+  return writev(Hist->FD, Parts, 2) == -1;
+}
+
+int initHistoryFile(Shell *S, int Interactive) {
+  char Path[MAX_PATH_LEN];
+  const char *File = getVariable("WSH_HISTFILE", S->VA);
+  if (File == NULL) {
+    const char *Home = getVariable("HOME", S->VA);
+    if (!Interactive || Home == NULL)
+      return 0;
+    snprintf(Path, sizeof(Path), "%s/.wsh_history", Home);
+    File = Path;
+  }
+  if (File[0] == '\0')
+    return 0;
+  return openHistoryFile(File, S->Hist);
+}
+
+int openHistoryFile(const char *Path, History *Hist) {
+  Hist->FD = open(Path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (Hist->FD == -1) {
+    fprintf(stderr, "wsh: cannot open history file '%s'\n", Path);
+    return 1;
+  }
+  return loadHistoryFile(Hist);
+}
+
+int loadHistoryFile(History *Hist) {
+  struct stat St;
+  if (fstat(Hist->FD, &St) == -1 || St.st_size == 0)
+    return 0;
+  off_t PageMask = sysconf(_SC_PAGESIZE) - 1;
+  for (off_t Window = HISTORY_TAIL_WINDOW;; Window *= 2) {
+    off_t Offset = St.st_size > Window ? (St.st_size - Window) & ~PageMask : 0;
+    size_t MapLen = St.st_size - Offset;
+    char *Map = (char *)mmap(NULL, MapLen, PROT_READ, MAP_PRIVATE, Hist->FD,
+                             Offset);
+    if (Map == MAP_FAILED) {
+      perror("mmap");
+      return 1;
+    }
+    char *End = Map + MapLen;
+    char *Cursor = End[-1] == '\n' ? End - 1 : End;
+    int Found = 0;
+    for (; Found < Hist->Capacity; Found++) {
+      char *NewLine = (char *)memrchr(Map, '\n', Cursor - Map);
+      if (NewLine == NULL)
+        break;
+      Cursor = NewLine;
+    }
+    char *First = Found == Hist->Capacity ? Cursor + 1
+                  : Offset == 0           ? Map
+                                          : NULL;
+    char *Start = First;
+    while (First != NULL && First < End) {
+      char *NewLine = (char *)memchr(First, '\n', End - First);
+      char *LineEnd = NewLine == NULL ? End : NewLine;
+      if (LineEnd > First)
+        pushHistory(Hist, First, LineEnd - First);
+      First = LineEnd + 1;
+    }
+    munmap(Map, MapLen);
+    if (Start != NULL)
+      return 0;
+  }
+}
+
+int setHistoryCapacity(int Capacity, History *Hist) {
+  HistoryEntry **NewEntries =
+      (HistoryEntry **)calloc(Capacity, sizeof(HistoryEntry *));
+  if (NewEntries == NULL)
+    return 1;
+  int Count = Hist->Count < Capacity ? Hist->Count : Capacity;
+  int NumRemoveEntries = Hist->Count - Count;
+  for (int i = 0; i < Hist->Count; i++) {
+    HistoryEntry *Entry = Hist->Entries[(Hist->Head + i) % Hist->Capacity];
+    if (i < NumRemoveEntries)
+      releaseHistoryEntry(Entry, Hist);
+    else
+      NewEntries[i - NumRemoveEntries] = Entry;
+  }
+  free(Hist->Entries);
+  Hist->Entries = NewEntries;
+  Hist->Head = 0;
+  Hist->Count = Count;
+  Hist->Capacity = Capacity;
+  return 0;
+}
+
+const char *getHistory(int NumEntry, History *Hist) {
+  if (NumEntry < 1 || NumEntry > Hist->Count)
+    return NULL;
+  int i = (Hist->Head + Hist->Count - NumEntry) % Hist->Capacity;
+  return Hist->Entries[i]->Text;
+}
+
+void freeHistory(History *Hist) {
+  if (Hist == NULL)
+    return;
+  if (Hist->Pool) {
+    for (int i = 0; i < Hist->PoolCapacity; i++)
+      free(Hist->Pool[i]);
+    free(Hist->Pool);
+  }
+  HistoryIndex *Pending;
+  if (joinHistoryIndex(Hist, &Pending))
+    freeHistoryIndex(Pending);
+  if (Hist->FD != -1)
+    close(Hist->FD);
+  freeHistoryIndex(Hist->Index);
+  free(Hist->Entries);
+  free(Hist);
+}
+
+HistoryIndex *initHistoryIndex(void) {
+  HistoryIndex *Index = (HistoryIndex *)calloc(1, sizeof(HistoryIndex));
+  if (Index == NULL)
+    return NULL;
+  Index->Capacity = INITIAL_HISTORY_INDEX_CAPACITY;
+  Index->Offsets = (size_t *)malloc((Index->Capacity + 1) * sizeof(size_t));
+  Index->TextCapacity = INITIAL_HISTORY_INDEX_CAPACITY * 32;
+  Index->Text = (char *)malloc(Index->TextCapacity);
+  Index->ListCapacity = INITIAL_HISTORY_INDEX_CAPACITY;
+  Index->Lists =
+      (TrigramPosting *)calloc(Index->ListCapacity, sizeof(TrigramPosting));
+  if (Index->Offsets == NULL || Index->Text == NULL || Index->Lists == NULL) {
+    freeHistoryIndex(Index);
+    return NULL;
+  }
+  Index->Offsets[0] = 0;
+  return Index;
+}
+
+unsigned int getTrigram(const char *Str) {
+  return (1u << 24) | ((unsigned char)Str[0] << 16) |
+         ((unsigned char)Str[1] << 8) | (unsigned char)Str[2];
+}
+
+TrigramPosting *findTrigramPosting(HistoryIndex *Index, unsigned int Key) {
+  int Mask = Index->ListCapacity - 1;
+  for (int i = (Key * 2654435761u) & Mask;; i = (i + 1) & Mask)
+    if (Index->Lists[i].Key == Key || Index->Lists[i].Key == 0)
+      return &Index->Lists[i];
+}
+
+int addTrigram(HistoryIndex *Index, unsigned int Key, int ID) {
+  if ((Index->NumLists + 1) * 2 > Index->ListCapacity) {
+    HistoryIndex Grown = *Index;
+    Grown.ListCapacity = Index->ListCapacity * 2;
+    Grown.Lists =
+        (TrigramPosting *)calloc(Grown.ListCapacity, sizeof(TrigramPosting));
+    if (Grown.Lists == NULL)
+      return 1;
+    for (int i = 0; i < Index->ListCapacity; i++)
+      if (Index->Lists[i].Key != 0)
+        *findTrigramPosting(&Grown, Index->Lists[i].Key) = Index->Lists[i];
+    free(Index->Lists);
+    Index->Lists = Grown.Lists;
+    Index->ListCapacity = Grown.ListCapacity;
+  }
+  TrigramPosting *List = findTrigramPosting(Index, Key);
+  if (List->Key == 0) {
+    List->Key = Key;
+    Index->NumLists++;
+  }
+  if (List->Count > 0 && List->IDs[List->Count - 1] == ID)
+    return 0;
+  if (List->Count == List->Capacity) {
+    int NewCapacity =
+        List->Capacity == 0 ? INITIAL_POSTING_CAPACITY : List->Capacity * 2;
+    int *NewIDs = (int *)realloc(List->IDs, NewCapacity * sizeof(int));
+    if (NewIDs == NULL)
+      return 1;
+    List->IDs = NewIDs;
+    List->Capacity = NewCapacity;
+  }
+  List->IDs[List->Count++] = ID;
+  return 0;
+}
+
+int addHistoryIndexLine(HistoryIndex *Index, const char *Line, size_t Len) {
+  if (Index->Count == Index->Capacity) {
+    size_t *NewOffsets = (size_t *)realloc(
+        Index->Offsets, (Index->Capacity * 2 + 1) * sizeof(size_t));
+    if (NewOffsets == NULL)
+      return 1;
+    Index->Offsets = NewOffsets;
+    Index->Capacity *= 2;
+  }
+  size_t Start = Index->Offsets[Index->Count];
+  if (Start + Len + 1 > Index->TextCapacity) {
+    size_t NewCapacity = (Start + Len + 1) * 2;
+    char *NewText = (char *)realloc(Index->Text, NewCapacity);
+    if (NewText == NULL)
+      return 1;
+    Index->Text = NewText;
+    Index->TextCapacity = NewCapacity;
+  }
+  memcpy(Index->Text + Start, Line, Len);
+  Index->Text[Start + Len] = '\0';
+  int ID = Index->Count++;
+  Index->Offsets[Index->Count] = Start + Len + 1;
+  for (size_t i = 0; i + 3 <= Len; i++)
+    if (addTrigram(Index, getTrigram(Line + i), ID))
+      return 1;
+  return 0;
+}
+
+const char *getHistoryIndexLine(HistoryIndex *Index, int ID, size_t *Len) {
+  *Len = Index->Offsets[ID + 1] - Index->Offsets[ID] - 1;
+  return Index->Text + Index->Offsets[ID];
+}
+
+int startHistoryIndex(History *Hist) {
+  struct stat St;
+  if (Hist->FD == -1 || fstat(Hist->FD, &St) == -1 || St.st_size == 0)
+    return 0;
+  Hist->IndexedSize = St.st_size;
+  if (pthread_create(&Hist->IndexThread, NULL, historyIndexWorker, Hist) != 0)
+    return 1;
+  Hist->IndexOwner = getpid();
+  return 0;
+}
+
+void *historyIndexWorker(void *Arg) {
+  History *Hist = (History *)Arg;
+  HistoryIndex *Index = initHistoryIndex();
+  if (Index != NULL &&
+      indexHistoryFile(Index, Hist->FD, 0, Hist->IndexedSize)) {
+    freeHistoryIndex(Index);
+    return NULL;
+  }
+  return Index;
+}
+
+int indexHistoryFile(HistoryIndex *Index, int FD, off_t From, off_t To) {
+  if (To <= From)
+    return 0;
+  char *Map = (char *)mmap(NULL, To, PROT_READ, MAP_PRIVATE, FD, 0);
+  if (Map == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  madvise(Map, To, MADV_SEQUENTIAL);
+  for (char *Line = Map + From, *End = Map + To; Line < End;) {
+    char *NewLine = (char *)memchr(Line, '\n', End - Line);
+    char *LineEnd = NewLine == NULL ? End : NewLine;
+    if (LineEnd > Line)
+      addHistoryIndexLine(Index, Line, LineEnd - Line);
+    Line = LineEnd + 1;
+  }
+  munmap(Map, To);
+  return 0;
+}
+
+int joinHistoryIndex(History *Hist, HistoryIndex **Index) {
+  *Index = NULL;
+  if (Hist->IndexOwner == 0)
+    return 0;
+  int Owned = Hist->IndexOwner == getpid();
+  Hist->IndexOwner = 0;
+  if (!Owned)
+    return 0;
+  pthread_join(Hist->IndexThread, (void **)Index);
+  return 1;
+}
+
+HistoryIndex *getHistoryIndex(History *Hist) {
+  if (Hist->Index != NULL)
+    return Hist->Index;
+  HistoryIndex *Index;
+  off_t From = 0;
+  if (joinHistoryIndex(Hist, &Index) && Index != NULL)
+    From = Hist->IndexedSize;
+  else if ((Index = initHistoryIndex()) == NULL)
+    return NULL;
+  struct stat St;
+  if (Hist->FD != -1 && fstat(Hist->FD, &St) == 0 && St.st_size > 0) {
+    if (indexHistoryFile(Index, Hist->FD, From, St.st_size)) {
+      freeHistoryIndex(Index);
+      return NULL;
+    }
+  } else if (From == 0) {
+    for (int i = Hist->Count; i >= 1; i--) {
+      HistoryEntry *Entry =
+          Hist->Entries[(Hist->Head + Hist->Count - i) % Hist->Capacity];
+      addHistoryIndexLine(Index, Entry->Text, Entry->Len);
+    }
+  }
+  Hist->Index = Index;
+  return Index;
+}
+
+int findHistoryMatch(HistoryIndex *Index, const char *Pattern, size_t Len,
+                     int Before) {
+  if (Before > Index->Count)
+    Before = Index->Count;
+  if (Len < 3) {
+    for (int ID = Before - 1; ID >= 0; ID--) {
+      size_t LineLen;
+      const char *Line = getHistoryIndexLine(Index, ID, &LineLen);
+      if (memmem(Line, LineLen, Pattern, Len) != NULL)
+        return ID;
+    }
+    return -1;
+  }
+  TrigramPosting *Smallest = NULL;
+  for (size_t i = 0; i + 3 <= Len; i++) {
+    TrigramPosting *List = findTrigramPosting(Index, getTrigram(Pattern + i));
+    if (List->Key == 0)
+      return -1;
+    if (Smallest == NULL || List->Count < Smallest->Count)
+      Smallest = List;
+  }
+  int Low = 0;
+  int High = Smallest->Count;
+  while (Low < High) {
+    int Mid = (Low + High) / 2;
+    if (Smallest->IDs[Mid] < Before)
+      Low = Mid + 1;
+    else
+      High = Mid;
+  }
+  for (int i = Low - 1; i >= 0; i--) {
+    size_t LineLen;
+    const char *Line = getHistoryIndexLine(Index, Smallest->IDs[i], &LineLen);
+    if (memmem(Line, LineLen, Pattern, Len) != NULL)
+      return Smallest->IDs[i];
+  }
+  return -1;
+}
+
+void freeHistoryIndex(HistoryIndex *Index) {
+  if (Index == NULL)
+    return;
+  if (Index->Lists != NULL)
+    for (int i = 0; i < Index->ListCapacity; i++)
+      free(Index->Lists[i].IDs);
+  free(Index->Lists);
+  free(Index->Offsets);
+  free(Index->Text);
+  free(Index);
+}
+
+int compareStrs(const void *A, const void *B) {
+  const char *StrA = *(const char **)A;
+  const char *StrB = *(const char **)B;
+
+  while (*StrA && *StrB) {
+    if (isalnum(*StrA) && isalnum(*StrB)) {
+      if (*StrA != *StrB) {
+        return *StrA - *StrB;
+      }
+      StrA++;
+      StrB++;
+    } else {
+      if (!isalnum(*StrA))
+        StrA++;
+      if (!isalnum(*StrB))
+        StrB++;
+    }
+  }
+
+  if (*StrA)
+    return 1;
+  if (*StrB)
+    return -1;
+  return 0;
+}
+
+Writer *initWriter(int FD, size_t Capacity) {
+  Writer *W = (Writer *)malloc(sizeof(Writer));
+  if (W == NULL)
+    return NULL;
+  W->Data = (char *)malloc(Capacity);
+  if (W->Data == NULL) {
+    free(W);
+    return NULL;
+  }
+  W->FD = FD;
+  W->Len = 0;
+  W->Capacity = Capacity;
+  W->LineBuffered = isatty(FD);
+  return W;
+}
+
+int writeBytes(Writer *W, const char *Data, size_t Len) {
+  if (W->Len + Len > W->Capacity && W->FD != -1) {
+    struct iovec Vec[2] = {{W->Data, W->Len}, {(void *)Data, Len}};
+    W->Len = 0;
+    return writeAllVector(W->FD, Vec, 2);
+  }
+  if (W->Len + Len > W->Capacity && growWriter(W, W->Len + Len))
+    return 1;
+  memcpy(W->Data + W->Len, Data, Len);
+  W->Len += Len;
+  if (W->LineBuffered && memchr(Data, '\n', Len) != NULL)
+    return flushWriter(W);
+  return 0;
+}
+
+int writeFormat(Writer *W, const char *Format, ...) {
+  va_list Args;
+  va_start(Args, Format);
+  size_t Space = W->Capacity - W->Len;
+  int Len = vsnprintf(W->Data + W->Len, Space, Format, Args);
+  va_end(Args);
+  if (Len < 0)
+    return 1;
+  if ((size_t)Len >= Space) {
+    char *Buffer = (char *)malloc(Len + 1);
+    if (Buffer == NULL)
+      return 1;
+    va_start(Args, Format);
+    vsnprintf(Buffer, Len + 1, Format, Args);
+    va_end(Args);
+    int Err = writeBytes(W, Buffer, Len);
+    free(Buffer);
+    return Err;
+  }
+  W->Len += Len;
+  if (W->LineBuffered && memchr(W->Data + W->Len - Len, '\n', Len) != NULL)
+    return flushWriter(W);
+  return 0;
+}
+
+int growWriter(Writer *W, size_t Capacity) {
+  size_t NewCapacity = W->Capacity * 2 > Capacity ? W->Capacity * 2 : Capacity;
+  char *NewData = (char *)realloc(W->Data, NewCapacity);
+  if (NewData == NULL)
+    return 1;
+  W->Data = NewData;
+  W->Capacity = NewCapacity;
+  return 0;
+}
+
+int flushWriter(Writer *W) {
+  if (W->FD == -1)
+    return 0;
+  size_t Len = W->Len;
+  W->Len = 0;
+  return writeAll(W->FD, W->Data, Len);
+}
+
+void freeWriter(Writer *W) {
+  if (W == NULL)
+    return;
+  free(W->Data);
+  free(W);
+}
+
+ssize_t readDirectoryBatch(int DirFD, char *Buffer, size_t Size) {
+  return syscall(SYS_getdents64, DirFD, Buffer, Size);
+}
+
+uint64_t getNameKey(const char *Name) {
+  uint64_t Key = 0;
+  int i = 0;
+  for (; i < 8 && Name[i] != '\0'; i++)
+    Key = Key << 8 | (unsigned char)Name[i];
+  return i == 0 ? 0 : Key << (8 * (8 - i));
+}
+
+int compareDirEntries(const void *A, const void *B) {
+  const DirEntry *EntryA = (const DirEntry *)A;
+  const DirEntry *EntryB = (const DirEntry *)B;
+  if (EntryA->Key != EntryB->Key)
+    return EntryA->Key < EntryB->Key ? -1 : 1;
+  return strcmp(EntryA->Name, EntryB->Name);
+}
+
+int streamDirectory(int DirFD, Writer *W) {
+  char *Buffer = (char *)malloc(DENTS_BUFFER_SIZE);
+  if (Buffer == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  ssize_t N;
+  while ((N = readDirectoryBatch(DirFD, Buffer, DENTS_BUFFER_SIZE)) > 0) {
+    for (ssize_t Off = 0; Off < N;) {
+      LinuxDirent64 *D = (LinuxDirent64 *)(Buffer + Off);
+      Off += D->RecLen;
+      if (D->Name[0] == '.')
+        continue;
+      size_t Len = strlen(D->Name);
+      D->Name[Len] = '\n';
+      writeBytes(W, D->Name, Len + 1);
+    }
+  }
+  if (N == -1)
+    perror("getdents64");
+  free(Buffer);
+  return N == -1;
+}
+
+DirEntry *readDirectory(int DirFD, Arena *A, int *Count) {
+  char *Buffer = (char *)malloc(DENTS_BUFFER_SIZE);
+  int Capacity = INITIAL_DIR_ENTRIES_CAPACITY;
+  DirEntry *Entries = (DirEntry *)malloc(Capacity * sizeof(DirEntry));
+  if (Buffer == NULL || Entries == NULL) {
+    perror("malloc");
+    free(Buffer);
+    free(Entries);
+    return NULL;
+  }
+  *Count = 0;
+  ssize_t N;
+  while ((N = readDirectoryBatch(DirFD, Buffer, DENTS_BUFFER_SIZE)) > 0) {
+    char *Batch = (char *)arenaAlloc(A, N);
+    memcpy(Batch, Buffer, N);
+    for (ssize_t Off = 0; Off < N;) {
+      LinuxDirent64 *D = (LinuxDirent64 *)(Batch + Off);
+      Off += D->RecLen;
+      if (D->Name[0] == '.')
+        continue;
+      if (*Count == Capacity) {
+        DirEntry *NewEntries =
+            (DirEntry *)realloc(Entries, 2 * Capacity * sizeof(DirEntry));
+        if (NewEntries == NULL) {
+          perror("realloc");
+          goto Error;
+        }
+        Entries = NewEntries;
+        Capacity *= 2;
+      }
+      Entries[*Count].Key = getNameKey(D->Name);
+      Entries[(*Count)++].Name = D->Name;
+    }
+  }
+  if (N == -1) {
+    perror("getdents64");
+    goto Error;
+  }
+  free(Buffer);
+  return Entries;
+Error:
+  free(Buffer);
+  free(Entries);
+  return NULL;
+}
+
+void *statWorker(void *Arg) {
+  StatBatch *B = (StatBatch *)Arg;
+  for (;;) {
+    int Start = __atomic_fetch_add(&B->Next, STAT_CHUNK_SIZE, __ATOMIC_RELAXED);
+    if (Start >= B->Count)
+      return NULL;
+    int End = Start + STAT_CHUNK_SIZE < B->Count ? Start + STAT_CHUNK_SIZE
+                                                  : B->Count;
+    for (int i = Start; i < End; i++)
+      if (statx(B->DirFD, B->Entries[i].Name,
+                AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_BASIC_STATS,
+                &B->Stats[i]) == -1)
+        B->Stats[i].stx_mask = 0;
+  }
+}
+
+void statDirectory(StatBatch *B) {
+  long NumCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+  int NumWorkers = (B->Count + STAT_CHUNK_SIZE - 1) / STAT_CHUNK_SIZE;
+  if (NumWorkers > NumCPUs)
+    NumWorkers = NumCPUs;
+  if (NumWorkers > MAX_STAT_WORKERS)
+    NumWorkers = MAX_STAT_WORKERS;
+  pthread_t Threads[MAX_STAT_WORKERS];
+  int NumStarted = 0;
+  B->Next = 0;
+  for (int i = 1; i < NumWorkers; i++)
+    if (pthread_create(&Threads[NumStarted], NULL, statWorker, B) == 0)
+      NumStarted++;
+  statWorker(B);
+  for (int i = 0; i < NumStarted; i++)
+    pthread_join(Threads[i], NULL);
+}
+
+void formatMode(mode_t Mode, char *Out) {
+  Out[0] = S_ISDIR(Mode)    ? 'd'
+           : S_ISLNK(Mode)  ? 'l'
+           : S_ISCHR(Mode)  ? 'c'
+           : S_ISBLK(Mode)  ? 'b'
+           : S_ISFIFO(Mode) ? 'p'
+           : S_ISSOCK(Mode) ? 's'
+                            : '-';
+  const char *Perms = "rwxrwxrwx";
+  for (int i = 0; i < 9; i++)
+    Out[i + 1] = Mode & (1 << (8 - i)) ? Perms[i] : '-';
+  if (Mode & S_ISUID)
+    Out[3] = Mode & S_IXUSR ? 's' : 'S';
+  if (Mode & S_ISGID)
+    Out[6] = Mode & S_IXGRP ? 's' : 'S';
+  if (Mode & S_ISVTX)
+    Out[9] = Mode & S_IXOTH ? 't' : 'T';
+  Out[10] = '\0';
+}
+
+void writeLongEntry(Writer *W, int DirFD, const char *Name,
+                    const struct statx *St) {
+  char Line[MAX_PATH_LEN + 128];
+  int Len;
+  if (St->stx_mask == 0) {
+    Len = snprintf(Line, sizeof(Line), "?????????? ? ? ? ? ? %s\n", Name);
+    writeBytes(W, Line, Len);
+    return;
+  }
+  char Mode[11];
+  formatMode(St->stx_mode, Mode);
+  char Time[32];
+  time_t MTime = St->stx_mtime.tv_sec;
+  struct tm Tm;
+  localtime_r(&MTime, &Tm);
+  strftime(Time, sizeof(Time), "%b %e %H:%M", &Tm);
+  Len = snprintf(Line, sizeof(Line), "%s %3u %5u %5u %10llu %s %s", Mode,
+                 St->stx_nlink, St->stx_uid, St->stx_gid,
+                 (unsigned long long)St->stx_size, Time, Name);
+  if (S_ISLNK(St->stx_mode)) {
+    Len += snprintf(Line + Len, sizeof(Line) - Len, " -> ");
+    ssize_t N = readlinkat(DirFD, Name, Line + Len, sizeof(Line) - Len - 1);
+    if (N > 0)
+      Len += N;
+  }
+  Line[Len++] = '\n';
+  writeBytes(W, Line, Len);
+}
+
+int listDirectory(int DirFD, int Sort, int Long, Writer *W, Arena *A) {
+  int Count;
+  DirEntry *Entries = readDirectory(DirFD, A, &Count);
+  if (Entries == NULL)
+    return 1;
+  if (Sort)
+    qsort(Entries, Count, sizeof(DirEntry), compareDirEntries);
+  if (!Long) {
+    for (int i = 0; i < Count; i++) {
+      size_t Len = strlen(Entries[i].Name);
+      Entries[i].Name[Len] = '\n';
+      writeBytes(W, Entries[i].Name, Len + 1);
+    }
+    free(Entries);
+    return 0;
+  }
+  int WindowSize = Count < STAT_WINDOW_SIZE ? Count : STAT_WINDOW_SIZE;
+  StatBatch B = {DirFD, NULL, NULL, 0, 0};
+  B.Stats = (struct statx *)malloc(WindowSize * sizeof(struct statx));
+  if (B.Stats == NULL && WindowSize > 0) {
+    perror("malloc");
+    free(Entries);
+    return 1;
+  }
+  for (int Base = 0; Base < Count; Base += WindowSize) {
+    B.Entries = Entries + Base;
+    B.Count = Count - Base < WindowSize ? Count - Base : WindowSize;
+    statDirectory(&B);
+    for (int i = 0; i < B.Count; i++)
+      writeLongEntry(W, DirFD, B.Entries[i].Name, &B.Stats[i]);
+  }
+  free(B.Stats);
+  free(Entries);
+  return 0;
+}
+
+int openPidFD(pid_t PID) {
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, PID, 0);
+#else
+  (void)PID;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+double getTime(void) {
+  struct timespec Ts;
+  clock_gettime(CLOCK_MONOTONIC, &Ts);
+  return Ts.tv_sec + Ts.tv_nsec / 1e9;
+}
+
+double getTimevalSeconds(struct timeval Tv) {
+  return Tv.tv_sec + Tv.tv_usec / 1e6;
+}
+
+void getJobUsage(Job *J, ResourceUsage *U) {
+  memset(U, 0, sizeof(ResourceUsage));
+  U->Real = J->EndTime - J->StartTime;
+  for (int i = 0; i < J->NumProcs; i++) {
+    struct rusage *Usage = &J->Procs[i].Usage;
+    U->User += getTimevalSeconds(Usage->ru_utime);
+    U->Sys += getTimevalSeconds(Usage->ru_stime);
+    if (Usage->ru_maxrss > U->MaxRSS)
+      U->MaxRSS = Usage->ru_maxrss;
+    U->VoluntarySwitches += Usage->ru_nvcsw;
+    U->InvoluntarySwitches += Usage->ru_nivcsw;
+  }
+}
+
+void reportUsage(Shell *S, const ResourceUsage *U, const char *Line) {
+  writeFormat(S->Err,
+              "real %.3fs user %.3fs sys %.3fs maxrss %ldKiB csw %ld/%ld",
+              U->Real, U->User, U->Sys, U->MaxRSS, U->VoluntarySwitches,
+              U->InvoluntarySwitches);
+  if (Line != NULL)
+    writeFormat(S->Err, "\t%s", Line);
+  writeBytes(S->Err, "\n", 1);
+}
+
+int isTimeAll(Shell *S) {
+  const char *Value = getVariable("WSH_TIME", S->VA);
+  return Value != NULL && Value[0] != '\0' && strcmp(Value, "0") != 0;
+}
+
+int getExitStatus(int WaitStatus) {
+  return WIFEXITED(WaitStatus) ? WEXITSTATUS(WaitStatus) : 1;
+}
+
+JobTable *initJobTable(void) {
+  JobTable *JT = (JobTable *)calloc(1, sizeof(JobTable));
+  if (JT == NULL)
+    return NULL;
+  JT->SignalFD = -1;
+  JT->EpollFD = epoll_create1(EPOLL_CLOEXEC);
+  if (JT->EpollFD == -1) {
+    free(JT);
+    return NULL;
+  }
+  int FD = openPidFD(getpid());
+  if (FD != -1) {
+    close(FD);
+    return JT;
+  }
+  JT->TableCapacity = INITIAL_JOB_TABLE_CAPACITY;
+  JT->Table = (JobProcess **)calloc(JT->TableCapacity, sizeof(JobProcess *));
+  sigset_t Mask;
+  sigemptyset(&Mask);
+  sigaddset(&Mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &Mask, NULL);
+  JT->SignalFD = signalfd(-1, &Mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  struct epoll_event Event = {.events = EPOLLIN, .data.ptr = NULL};
+  if (JT->Table == NULL || JT->SignalFD == -1 ||
+      epoll_ctl(JT->EpollFD, EPOLL_CTL_ADD, JT->SignalFD, &Event) == -1) {
+    freeJobTable(JT);
+    return NULL;
+  }
+  return JT;
+}
+
+Job *initJob(int NumProcs, const char *Line, size_t Len) {
+  Job *J = (Job *)calloc(1, sizeof(Job) + NumProcs * sizeof(JobProcess));
+  if (J == NULL)
+    return NULL;
+  J->Line = strndup(Line, Len);
+  if (J->Line == NULL) {
+    free(J);
+    return NULL;
+  }
+  J->NumProcs = NumProcs;
+  J->StartTime = getTime();
+  for (int i = 0; i < NumProcs; i++) {
+    J->Procs[i].Job = J;
+    J->Procs[i].PIDFD = -1;
+    J->Procs[i].Status = 1;
+  }
+  return J;
+}
+
+JobProcess **findJobProcess(pid_t PID, JobTable *JT) {
+  int Mask = JT->TableCapacity - 1;
+  for (int i = ((unsigned int)PID * 2654435761u) & Mask;; i = (i + 1) & Mask)
+    if (JT->Table[i] == NULL || JT->Table[i]->PID == PID)
+      return &JT->Table[i];
+}
+
+int addJobProcess(JobProcess *Proc, JobTable *JT) {
+  if ((JT->NumEntries + 1) * 2 > JT->TableCapacity) {
+    JobTable Grown = *JT;
+    Grown.TableCapacity = JT->TableCapacity * 2;
+    Grown.Table =
+        (JobProcess **)calloc(Grown.TableCapacity, sizeof(JobProcess *));
+    if (Grown.Table == NULL)
+      return 1;
+    for (int i = 0; i < JT->TableCapacity; i++)
+      if (JT->Table[i] != NULL)
+        *findJobProcess(JT->Table[i]->PID, &Grown) = JT->Table[i];
+    free(JT->Table);
+    JT->Table = Grown.Table;
+    JT->TableCapacity = Grown.TableCapacity;
+  }
+  *findJobProcess(Proc->PID, JT) = Proc;
+  JT->NumEntries++;
+  return 0;
+}
+
+void removeJobProcess(pid_t PID, JobTable *JT) {
+  int Mask = JT->TableCapacity - 1;
+  int i = findJobProcess(PID, JT) - JT->Table;
+  if (JT->Table[i] == NULL)
+    return;
+  for (int j = (i + 1) & Mask; JT->Table[j] != NULL; j = (j + 1) & Mask) {
+    int Home = ((unsigned int)JT->Table[j]->PID * 2654435761u) & Mask;
+    if (i <= j ? (i < Home && Home <= j) : (i < Home || Home <= j))
+      continue;
+    JT->Table[i] = JT->Table[j];
+    i = j;
+  }
+  JT->Table[i] = NULL;
+  JT->NumEntries--;
+}
+
+int watchJobProcess(JobProcess *Proc, JobTable *JT) {
+  Proc->Job->NumRunning++;
+  if (JT->SignalFD != -1 && addJobProcess(Proc, JT) == 0)
+    return 0;
+  if (JT->SignalFD == -1) {
+    Proc->PIDFD = openPidFD(Proc->PID);
+    struct epoll_event Event = {.events = EPOLLIN, .data.ptr = Proc};
+    if (Proc->PIDFD != -1 &&
+        epoll_ctl(JT->EpollFD, EPOLL_CTL_ADD, Proc->PIDFD, &Event) == 0)
+      return 0;
+    perror("pidfd_open");
+  }
+  int WaitStatus = 0;
+  struct rusage Usage;
+  memset(&Usage, 0, sizeof(Usage));
+  wait4(Proc->PID, &WaitStatus, 0, &Usage);
+  reapJobProcess(Proc, getExitStatus(WaitStatus), &Usage, JT);
+  return 1;
+}
+
+void reapJobProcess(JobProcess *Proc, int Status, const struct rusage *Usage,
+                    JobTable *JT) {
+  if (Proc->PIDFD != -1) {
+    epoll_ctl(JT->EpollFD, EPOLL_CTL_DEL, Proc->PIDFD, NULL);
+    close(Proc->PIDFD);
+    Proc->PIDFD = -1;
+  } else if (JT->SignalFD != -1) {
+    removeJobProcess(Proc->PID, JT);
+  }
+  Proc->Status = Status;
+  if (Usage != NULL)
+    Proc->Usage = *Usage;
+  if (--Proc->Job->NumRunning == 0)
+    Proc->Job->EndTime = getTime();
+}
+
+int pollJobs(JobTable *JT, int Timeout) {
+  struct epoll_event Events[MAX_JOB_EVENTS];
+  int NumReady = epoll_wait(JT->EpollFD, Events, MAX_JOB_EVENTS, Timeout);
+  if (NumReady == -1 && errno != EINTR)
+    perror("epoll_wait");
+  for (int i = 0; i < NumReady; i++) {
+    JobProcess *Proc = (JobProcess *)Events[i].data.ptr;
+    int WaitStatus;
+    struct rusage Usage;
+    if (Proc != NULL) {
+      pid_t PID = wait4(Proc->PID, &WaitStatus, WNOHANG, &Usage);
+      if (PID == Proc->PID)
+        reapJobProcess(Proc, getExitStatus(WaitStatus), &Usage, JT);
+      else if (PID == -1)
+        reapJobProcess(Proc, 1, NULL, JT);
+      continue;
+    }
+    struct signalfd_siginfo Info;
+    while (read(JT->SignalFD, &Info, sizeof(Info)) > 0)
+      ;
+    pid_t PID;
+    while ((PID = wait4(-1, &WaitStatus, WNOHANG, &Usage)) > 0) {
+      JobProcess **Slot = findJobProcess(PID, JT);
+      if (*Slot != NULL)
+        reapJobProcess(*Slot, getExitStatus(WaitStatus), &Usage, JT);
+    }
+  }
+  return NumReady;
+}
+
+int waitJob(Job *J, JobTable *JT) {
+  while (J->NumRunning > 0)
+    if (pollJobs(JT, -1) == -1 && errno != EINTR)
+      break;
+  return J->Procs[J->NumProcs - 1].Status;
+}
+
+int addJob(Job *J, JobTable *JT) {
+  if (JT->Count == JT->Capacity) {
+    int NewCapacity =
+        JT->Capacity == 0 ? INITIAL_JOBS_CAPACITY : JT->Capacity * 2;
+    Job **NewJobs = (Job **)realloc(JT->Jobs, NewCapacity * sizeof(Job *));
+    if (NewJobs == NULL)
+      return 1;
+    JT->Jobs = NewJobs;
+    JT->Capacity = NewCapacity;
+  }
+  J->ID = JT->Count == 0 ? 1 : JT->Jobs[JT->Count - 1]->ID + 1;
+  JT->Jobs[JT->Count++] = J;
+  return 0;
+}
+
+int findJob(const char *Spec, JobTable *JT) {
+  if (Spec[0] == '%')
+    Spec++;
+  char *End;
+  long ID = strtol(Spec, &End, 10);
+  if (End == Spec || *End != '\0')
+    return -1;
+  int Low = 0;
+  int High = JT->Count;
+  while (Low < High) {
+    int Mid = (Low + High) / 2;
+    if (JT->Jobs[Mid]->ID < ID)
+      Low = Mid + 1;
+    else
+      High = Mid;
+  }
+  return Low < JT->Count && JT->Jobs[Low]->ID == ID ? Low : -1;
+}
+
+void removeJob(int Index, JobTable *JT) {
+  freeJob(JT->Jobs[Index]);
+  memmove(JT->Jobs + Index, JT->Jobs + Index + 1,
+          (JT->Count - Index - 1) * sizeof(Job *));
+  JT->Count--;
+}
+
+void updateJobs(Shell *S) {
+  JobTable *JT = S->Jobs;
+  if (JT->Count == 0)
+    return;
+  while (pollJobs(JT, 0) == MAX_JOB_EVENTS)
+    ;
+  if (!S->Interactive)
+    return;
+  for (int i = 0; i < JT->Count;) {
+    Job *J = JT->Jobs[i];
+    if (J->NumRunning > 0) {
+      i++;
+      continue;
+    }
+    writeFormat(S->Err, "[%d] Done\t%s\n", J->ID, J->Line);
+    removeJob(i, JT);
+  }
+}
+
+void freeJob(Job *J) {
+  if (J == NULL)
+    return;
+  for (int i = 0; i < J->NumProcs; i++)
+    if (J->Procs[i].PIDFD != -1)
+      close(J->Procs[i].PIDFD);
+  free(J->Line);
+  free(J);
+}
+
+void freeJobTable(JobTable *JT) {
+  if (JT == NULL)
+    return;
+  for (int i = 0; i < JT->Count; i++)
+    freeJob(JT->Jobs[i]);
+  free(JT->Jobs);
+  free(JT->Table);
+  if (JT->SignalFD != -1)
+    close(JT->SignalFD);
+  close(JT->EpollFD);
+  free(JT);
+}
+
+ParallelRunner *initParallelRunner(Shell *S) {
+  ParallelRunner *PR = (ParallelRunner *)calloc(1, sizeof(ParallelRunner));
+  if (PR == NULL)
+    return NULL;
+  PR->Capacity = S->Parallelism * PARALLEL_WINDOW_FACTOR;
+  PR->Lines = (ParallelLine *)calloc(PR->Capacity, sizeof(ParallelLine));
+  PR->EpollFD = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event Event = {.events = EPOLLIN, .data.ptr = NULL};
+  if (PR->Lines == NULL || PR->EpollFD == -1 ||
+      epoll_ctl(PR->EpollFD, EPOLL_CTL_ADD, S->Jobs->EpollFD, &Event) == -1) {
+    freeParallelRunner(PR);
+    return NULL;
+  }
+  return PR;
+}
+
+int isParallelCommand(Command *Cmd) {
+  if (Cmd->Background || getBlockKeyword(Cmd) != KeywordNone)
+    return 0;
+  for (Command *Stage = Cmd; Stage != NULL; Stage = Stage->Next) {
+    BuiltinCommandInfo *BC = getBuiltinCommandInfo(Stage);
+    if (BC != NULL &&
+        (BC->Effect == BuiltinMutates ||
+         (BC->Effect == BuiltinReadOnlyBare && Stage->TokenCount > 1)))
+      return 0;
+    for (int i = 0; i < Stage->TokenCount; i++)
+      if (hasExpansionAssignment(Stage->Tokens[i]))
+        return 0;
+    if (Stage->Redirection != NULL &&
+        hasExpansionAssignment(Stage->Redirection->File))
+      return 0;
+  }
+  return 1;
+}
+
+int hasExpansionAssignment(const char *Token) {
+  if (hasArithmeticAssignment(Token))
+    return 1;
+  for (const char *P = strstr(Token, "${"); P != NULL;
+       P = strstr(P + 1, "${")) {
+    const char *Op = P + 2 + getVariableNameLen(P + 2);
+    if (Op > P + 2 && Op[*Op == ':'] == '=')
+      return 1;
+  }
+  return 0;
+}
+
+int hasArithmeticAssignment(const char *Token) {
+  size_t Len = strlen(Token);
+  for (const char *P = strstr(Token, "$(("); P != NULL;
+       P = strstr(P + 1, "$((")) {
+    size_t Start = P - Token + 1;
+    size_t End = findClosingBracket(Token, Start, Len);
+    if (End == (size_t)-1)
+      End = Len;
+    for (size_t i = Start + 2; i < End; i++) {
+      char C = Token[i];
+      if ((C == '+' || C == '-') && Token[i + 1] == C)
+        return 1;
+      if (C == '=' && Token[i + 1] != '=' &&
+          (strchr("=!<>", Token[i - 1]) == NULL ||
+           Token[i - 1] == Token[i - 2]))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+int launchParallelLine(ParallelRunner *PR, Command *Cmd, Shell *S) {
+  size_t Len;
+  char *Line = getCommandLine(Cmd, S->Arena, &Len);
+  if (getBuiltinCommandInfo(Cmd) == NULL || Cmd->Next != NULL)
+    addHistory(S->Hist, Line, Len);
+  int NumStages = 0;
+  for (Command *Stage = Cmd; Stage != NULL; Stage = Stage->Next)
+    NumStages++;
+  ParallelLine *PL = &PR->Lines[(PR->Head + PR->Count) % PR->Capacity];
+  memset(PL, 0, sizeof(ParallelLine));
+  PL->Job = initJob(NumStages, Line, Len);
+  if (PL->Job == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  if (isReadOnlyCommand(Cmd) &&
+      getBuiltinCommandInfo(Cmd)->Effect != BuiltinReadsInput) {
+    PR->Count++;
+    return captureParallelBuiltin(PL, Cmd, S);
+  }
+  PL->Timed = Cmd->Timed;
+  PL->TimeAll = isTimeAll(S);
+  int Pipes[2][2];
+  for (int i = 0; i < 2; i++) {
+    PL->Output[i].FD = -1;
+    if (pipe2(Pipes[i], O_CLOEXEC) == -1) {
+      perror("pipe");
+      Pipes[i][0] = Pipes[i][1] = -1;
+    }
+  }
+  flushShellOutput(S);
+  int ErrFD = S->Err->FD;
+  if (Pipes[1][1] != -1)
+    S->Err->FD = Pipes[1][1];
+  launchJob(PL->Job, Cmd, S, -1, Pipes[0][1], Pipes[1][1]);
+  flushWriter(S->Err);
+  S->Err->FD = ErrFD;
+  for (int i = 0; i < 2; i++) {
+    if (Pipes[i][1] == -1)
+      continue;
+    close(Pipes[i][1]);
+    struct epoll_event Event = {.events = EPOLLIN, .data.ptr = &PL->Output[i]};
+    if (epoll_ctl(PR->EpollFD, EPOLL_CTL_ADD, Pipes[i][0], &Event) == -1) {
+      close(Pipes[i][0]);
+      continue;
+    }
+    PL->Output[i].FD = Pipes[i][0];
+  }
+  PR->Count++;
+  PR->Running++;
+  return 0;
+}
+
+int captureParallelBuiltin(ParallelLine *PL, Command *Cmd, Shell *S) {
+  Writer *Saved[2] = {S->Out, S->Err};
+  Writer *Capture[2] = {initWriter(-1, CAPTURE_BUFFER_SIZE),
+                        initWriter(-1, CAPTURE_BUFFER_SIZE)};
+  int Error = Capture[0] == NULL || Capture[1] == NULL;
+  if (!Error) {
+    S->Out = Capture[0];
+    S->Err = Capture[1];
+    PL->Job->Procs[0].Status = execute(Cmd, S);
+    S->Out = Saved[0];
+    S->Err = Saved[1];
+  }
+  for (int i = 0; i < 2; i++) {
+    PL->Output[i].FD = -1;
+    if (Capture[i] == NULL)
+      continue;
+    PL->Output[i].Data = Capture[i]->Data;
+    PL->Output[i].Len = Capture[i]->Len;
+    PL->Output[i].Capacity = Capture[i]->Capacity;
+    free(Capture[i]);
+  }
+  if (Error)
+    perror("malloc");
+  return Error;
+}
+
+int growCapture(CaptureBuffer *Buf, size_t Capacity) {
+  char *NewData = (char *)realloc(Buf->Data, Capacity);
+  if (NewData == NULL)
+    return 1;
+  Buf->Data = NewData;
+  Buf->Capacity = Capacity;
+  return 0;
+}
+
+int readCapture(CaptureBuffer *Buf, int EpollFD) {
+  if (Buf->Len + CAPTURE_BUFFER_SIZE > Buf->Capacity &&
+      growCapture(Buf, (Buf->Len + CAPTURE_BUFFER_SIZE) * 2))
+    return 1;
+  ssize_t N = read(Buf->FD, Buf->Data + Buf->Len, Buf->Capacity - Buf->Len);
+  if (N > 0) {
+    Buf->Len += N;
+    return 0;
+  }
+  if (N == -1 && errno == EINTR)
+    return 0;
+  epoll_ctl(EpollFD, EPOLL_CTL_DEL, Buf->FD, NULL);
+  close(Buf->FD);
+  Buf->FD = -1;
+  return 0;
+}
+
+int writeAllVector(int FD, struct iovec *Vec, int Count) {
+  while (Count > 0) {
+    ssize_t N = writev(FD, Vec, Count);
+    if (N == -1 && errno == EINTR)
+      continue;
+    if (N == -1)
+      return 1;
+    for (; Count > 0 && (size_t)N >= Vec->iov_len; Vec++, Count--)
+      N -= Vec->iov_len;
+    if (Count > 0) {
+      Vec->iov_base = (char *)Vec->iov_base + N;
+      Vec->iov_len -= N;
+    }
+  }
+  return 0;
+}
+
+void flushShellOutput(Shell *S) {
+  fflush(stdout);
+  fflush(stderr);
+  flushWriter(S->Out);
+  flushWriter(S->Err);
+}
+
+void flushShellErrors(Shell *S) {
+  if (S->Err->Len > 0)
+    flushShellOutput(S);
+}
+
+int writeAll(int FD, const char *Data, size_t Len) {
+  while (Len > 0) {
+    ssize_t N = write(FD, Data, Len);
+    if (N == -1 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return 1;
+    Data += N;
+    Len -= N;
+  }
+  return 0;
+}
+
+int isParallelLineDone(ParallelLine *PL) {
+  return PL->Job->NumRunning == 0 && PL->Output[0].FD == -1 &&
+         PL->Output[1].FD == -1;
+}
+
+void stepParallelRunner(ParallelRunner *PR, Shell *S, int Timeout) {
+  if (PR->Count > 0 && isParallelLineDone(&PR->Lines[PR->Head]))
+    Timeout = 0;
+  struct epoll_event Events[MAX_JOB_EVENTS];
+  int NumReady = epoll_wait(PR->EpollFD, Events, MAX_JOB_EVENTS, Timeout);
+  if (NumReady == -1 && errno != EINTR)
+    perror("epoll_wait");
+  for (int i = 0; i < NumReady; i++) {
+    CaptureBuffer *Buf = (CaptureBuffer *)Events[i].data.ptr;
+    if (Buf == NULL)
+      pollJobs(S->Jobs, 0);
+    else if (readCapture(Buf, PR->EpollFD))
+      perror("realloc");
+  }
+  int Running = 0;
+  for (int i = 0; i < PR->Count; i++)
+    Running += !isParallelLineDone(&PR->Lines[(PR->Head + i) % PR->Capacity]);
+  PR->Running = Running;
+  while (PR->Count > 0 && isParallelLineDone(&PR->Lines[PR->Head])) {
+    ParallelLine *PL = &PR->Lines[PR->Head];
+    writeBytes(S->Out, PL->Output[0].Data, PL->Output[0].Len);
+    if (PL->Timed || PL->TimeAll)
+      getJobUsage(PL->Job, &S->LastUsage);
+    if (PL->Output[1].Len > 0 || PL->Timed || PL->TimeAll) {
+      flushWriter(S->Out);
+      writeBytes(S->Err, PL->Output[1].Data, PL->Output[1].Len);
+      if (PL->Timed || PL->TimeAll)
+        reportUsage(S, &S->LastUsage, PL->Timed ? NULL : PL->Job->Line);
+      flushWriter(S->Err);
+    }
+    S->Error = PL->Job->Procs[PL->Job->NumProcs - 1].Status;
+    freeParallelLine(PL);
+    PR->Head = (PR->Head + 1) % PR->Capacity;
+    PR->Count--;
+  }
+}
+
+void freeParallelLine(ParallelLine *PL) {
+  for (int i = 0; i < 2; i++) {
+    if (PL->Output[i].FD != -1)
+      close(PL->Output[i].FD);
+    free(PL->Output[i].Data);
+  }
+  freeJob(PL->Job);
+}
+
+void freeParallelRunner(ParallelRunner *PR) {
+  if (PR == NULL)
+    return;
+  for (int i = 0; i < PR->Count; i++)
+    freeParallelLine(&PR->Lines[(PR->Head + i) % PR->Capacity]);
+  if (PR->EpollFD != -1)
+    close(PR->EpollFD);
+  free(PR->Lines);
+  free(PR);
+}
+
+Profiler *initProfiler(const char *Path) {
+  Profiler *Prof = (Profiler *)calloc(1, sizeof(Profiler));
+  if (Prof == NULL)
+    return NULL;
+  Prof->Path = strdup(Path);
+  if (Prof->Path == NULL) {
+    free(Prof);
+    return NULL;
+  }
+  Prof->Origin = getTime();
+  return Prof;
+}
+
+double startSpan(Shell *S) { return S->Prof == NULL ? 0 : getTime(); }
+
+void endSpan(Shell *S, const char *Name, double Start) {
+  if (S->Prof != NULL)
+    addProfileSpan(S->Prof, Name, Start, getTime());
+}
+
+double startLineSpan(Shell *S) {
+  if (S->Prof == NULL)
+    return 0;
+  S->Prof->LineNumber++;
+  return getTime();
+}
+
+void endLineSpan(Shell *S, const char *Line, size_t Len, double Start) {
+  Profiler *Prof = S->Prof;
+  if (Prof == NULL)
+    return;
+  addProfileSpan(Prof, "line", Start, getTime());
+  if (Prof->LineNumber > Prof->LinesCapacity) {
+    int NewCapacity = Prof->LinesCapacity == 0 ? INITIAL_PROFILE_CAPACITY
+                                               : Prof->LinesCapacity * 2;
+    char **NewLines =
+        (char **)realloc(Prof->Lines, NewCapacity * sizeof(char *));
+    if (NewLines == NULL)
+      return;
+    memset(NewLines + Prof->LinesCapacity, 0,
+           (NewCapacity - Prof->LinesCapacity) * sizeof(char *));
+    Prof->Lines = NewLines;
+    Prof->LinesCapacity = NewCapacity;
+  }
+  if (Prof->Lines[Prof->LineNumber - 1] == NULL)
+    Prof->Lines[Prof->LineNumber - 1] = strndup(Line, Len);
+}
+
+void addProfileSpan(Profiler *Prof, const char *Name, double Start,
+                    double End) {
+  if (Prof->Count == Prof->Capacity) {
+    int NewCapacity =
+        Prof->Capacity == 0 ? INITIAL_PROFILE_CAPACITY : Prof->Capacity * 2;
+    ProfileSpan *NewSpans =
+        (ProfileSpan *)realloc(Prof->Spans, NewCapacity * sizeof(ProfileSpan));
+    if (NewSpans == NULL)
+      return;
+    Prof->Spans = NewSpans;
+    Prof->Capacity = NewCapacity;
+  }
+  ProfileSpan *Span = &Prof->Spans[Prof->Count++];
+  Span->Name = Name;
+  Span->Line = Prof->LineNumber;
+  Span->Start = Start - Prof->Origin;
+  Span->Duration = End - Start;
+}
+
+void writeJSONString(Writer *W, const char *Str) {
+  writeBytes(W, "\"", 1);
+  for (const char *P = Str; *P != '\0'; P++) {
+    unsigned char C = *P;
+    if (C == '"' || C == '\\')
+      writeFormat(W, "\\%c", C);
+    else if (C < 0x20)
+      writeFormat(W, "\\u%04x", C);
+    else
+      writeBytes(W, P, 1);
+  }
+  writeBytes(W, "\"", 1);
+}
+
+int writeProfile(Profiler *Prof) {
+  int FD = open(Prof->Path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (FD == -1) {
+    perror("open");
+    return 1;
+  }
+  Writer *W = initWriter(FD, WRITER_BUFFER_SIZE);
+  if (W == NULL) {
+    close(FD);
+    return 1;
+  }
+  writeFormat(W, "{\"traceEvents\": [");
+  for (int i = 0; i < Prof->Count; i++) {
+    ProfileSpan *Span = &Prof->Spans[i];
+    writeFormat(W,
+                "%s\n{\"name\": \"%s\", \"cat\": \"wsh\", \"ph\": \"X\", "
+                "\"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": 1, "
+                "\"args\": {\"line\": %d",
+                i > 0 ? "," : "", Span->Name, Span->Start * 1e6,
+                Span->Duration * 1e6, (int)getpid(), Span->Line);
+    if (Span->Name[0] == 'l' && Prof->Lines != NULL &&
+        Prof->Lines[Span->Line - 1] != NULL) {
+      writeFormat(W, ", \"command\": ");
+      writeJSONString(W, Prof->Lines[Span->Line - 1]);
+    }
+    writeFormat(W, "}}");
+  }
+  writeFormat(W, "\n]}\n");
+  int Err = flushWriter(W);
+  freeWriter(W);
+  close(FD);
+  return Err;
+}
+
+int compareProfileLines(const void *A, const void *B, void *Arg) {
+  const double *Totals = (const double *)Arg;
+  double X = Totals[*(const int *)A];
+  double Y = Totals[*(const int *)B];
+  return (X < Y) - (X > Y);
+}
+
+void reportProfile(Profiler *Prof, Writer *W) {
+  int NumLines = Prof->LineNumber;
+  if (NumLines == 0)
+    return;
+  double *Totals = (double *)calloc(2 * NumLines, sizeof(double));
+  int *Order = (int *)malloc(NumLines * sizeof(int));
+  if (Totals == NULL || Order == NULL) {
+    free(Totals);
+    free(Order);
+    return;
+  }
+  double *Waits = Totals + NumLines;
+  double Total = 0;
+  double Waited = 0;
+  for (int i = 0; i < Prof->Count; i++) {
+    ProfileSpan *Span = &Prof->Spans[i];
+    if (strcmp(Span->Name, "line") == 0) {
+      Totals[Span->Line - 1] += Span->Duration;
+      Total += Span->Duration;
+    } else if (strcmp(Span->Name, "wait") == 0) {
+      Waits[Span->Line - 1] += Span->Duration;
+      Waited += Span->Duration;
+    }
+  }
+  for (int i = 0; i < NumLines; i++)
+    Order[i] = i;
+  qsort_r(Order, NumLines, sizeof(int), compareProfileLines, Totals);
+  writeFormat(W,
+              "profile: %d lines, %.3fs total, %.3fs in shell, %.3fs "
+              "waiting on children\n",
+              NumLines, Total, Total - Waited, Waited);
+  writeFormat(W, "%8s %12s %12s %12s  %s\n", "line", "total ms", "shell ms",
+              "child ms", "command");
+  for (int i = 0; i < NumLines && i < PROFILE_REPORT_LINES; i++) {
+    int Line = Order[i];
+    if (Totals[Line] == 0)
+      break;
+    writeFormat(W, "%8d %12.3f %12.3f %12.3f  %s\n", Line + 1,
+                Totals[Line] * 1e3, (Totals[Line] - Waits[Line]) * 1e3,
+                Waits[Line] * 1e3,
+                Prof->Lines[Line] == NULL ? "" : Prof->Lines[Line]);
+  }
+  free(Totals);
+  free(Order);
+}
+
+void freeProfiler(Profiler *Prof) {
+  if (Prof == NULL)
+    return;
+  for (int i = 0; i < Prof->LinesCapacity; i++)
+    free(Prof->Lines[i]);
+  free(Prof->Lines);
+  free(Prof->Spans);
+  free(Prof->Path);
+  free(Prof);
+}
+
+void resetStats(Shell *S) {
+  memset(&S->Stats, 0, sizeof(ShellStats));
+  S->Stats.Since = getTime();
+  S->Cache->Probes = 0;
+  S->Cache->Hits = 0;
+  S->Cache->Misses = 0;
+  S->VA->Lookups = 0;
+}
+
+void recordLatency(LatencyHistogram *H, double Start, double End) {
+  double Elapsed = End - Start;
+  unsigned long Micros = (unsigned long)(Elapsed * 1e6);
+  int Bucket = Micros == 0 ? 0 : 63 - __builtin_clzl(Micros);
+  if (Bucket >= NUM_LATENCY_BUCKETS)
+    Bucket = NUM_LATENCY_BUCKETS - 1;
+  H->Buckets[Bucket]++;
+  H->Count++;
+  H->Sum += Elapsed;
+  if (Elapsed > H->Max)
+    H->Max = Elapsed;
+}
+
+double getLatencyPercentile(const LatencyHistogram *H, double Fraction) {
+  unsigned long Rank = (unsigned long)(Fraction * H->Count);
+  unsigned long Seen = 0;
+  for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+    Seen += H->Buckets[i];
+    if (Seen > Rank) {
+      double Bound = (double)(2UL << i) / 1e6;
+      return Bound < H->Max ? Bound : H->Max;
+    }
+  }
+  return H->Max;
+}
+
+void writeLatencyHistogram(Writer *W, const char *Name,
+                           const LatencyHistogram *H) {
+  double Mean = H->Count == 0 ? 0 : H->Sum / H->Count;
+  writeFormat(W, "%-8s %10lu %10.1f %10.0f %10.0f %10.0f %10.1f\n", Name,
+              H->Count, Mean * 1e6, getLatencyPercentile(H, 0.5) * 1e6,
+              getLatencyPercentile(H, 0.9) * 1e6,
+              getLatencyPercentile(H, 0.99) * 1e6, H->Max * 1e6);
+}
+
+void writeLatencyHistogramJSON(Writer *W, const char *Name,
+                               const LatencyHistogram *H) {
+  writeFormat(W,
+              "\"%s\": {\"count\": %lu, \"sum_us\": %.1f, \"max_us\": %.1f, "
+              "\"buckets\": [",
+              Name, H->Count, H->Sum * 1e6, H->Max * 1e6);
+  for (int i = 0; i < NUM_LATENCY_BUCKETS; i++)
+    writeFormat(W, "%s%lu", i > 0 ? ", " : "", H->Buckets[i]);
+  writeFormat(W, "]}");
+}
+
+int getPipeSize(Shell *S) {
+  const char *Value = getVariable("WSH_PIPESIZE", S->VA);
+  return Value == NULL ? 0 : atoi(Value);
+}
+
+pid_t launchStage(Command *Stage, Shell *S, int InFD, int OutFD, int ErrFD) {
+  FDMove Moves[5];
+  int NumMoves = 0;
+  if (InFD != -1)
+    Moves[NumMoves++] = (FDMove){InFD, STDIN_FILENO};
+  if (OutFD != -1)
+    Moves[NumMoves++] = (FDMove){OutFD, STDOUT_FILENO};
+  if (ErrFD != -1)
+    Moves[NumMoves++] = (FDMove){ErrFD, STDERR_FILENO};
+  BuiltinCommandInfo *BC = getBuiltinCommandInfo(Stage);
+  double Start = startSpan(S);
+  Stage = replaceVariables(Stage, S, 0);
+  endSpan(S, "expand", Start);
+  if (Stage == NULL)
+    return -1;
+  const char *ExecutablePath = NULL;
+  if (BC == NULL) {
+    Start = getTime();
+    ExecutablePath = findExecutable(Stage->Tokens[0], S->Cache);
+    recordLatency(&S->Stats.Lookup, Start, getTime());
+    endSpan(S, "lookup", Start);
+    if (ExecutablePath == NULL) {
+      writeFormat(S->Err, "command not found: %s\n", Stage->Tokens[0]);
+      return -1;
+    }
+  }
+  int NumRedirectMoves =
+      getRedirectMoves(Stage->Redirection, Moves + NumMoves, S->Err);
+  if (NumRedirectMoves == -1)
+    return -1;
+  int RedirectFD = NumRedirectMoves > 0 ? Moves[NumMoves].From : -1;
+  NumMoves += NumRedirectMoves;
+  pid_t PID;
+  Start = getTime();
+  if (BC == NULL) {
+    PID = spawnProcess(ExecutablePath, Stage->Tokens, Moves, NumMoves);
+    if (PID == -1) {
+      writeFormat(S->Err, "execv: %s\n", strerror(errno));
+      if (errno == ENOENT && ExecutablePath != Stage->Tokens[0])
+        clearExecutableCache(S->Cache);
+    }
+  } else {
+    flushWriter(S->Err);
+    PID = fork();
+    if (PID == 0) {
+      resetSignalMask();
+      for (int i = 0; i < NumMoves; i++)
+        dup2(Moves[i].From, Moves[i].To);
+      int Status = BC->Func(Stage, S);
+      flushShellOutput(S);
+      _exit(Status);
     }
+    if (PID == -1)
+      perror("fork");
   }
+  if (PID > 0) {
+    S->Stats.Forks++;
+    recordLatency(&S->Stats.Spawn, Start, getTime());
+  }
+  endSpan(S, "spawn", Start);
+  if (RedirectFD != -1)
+    close(RedirectFD);
+  return PID;
+}
 
-  if (*StrA)
-    return 1;
-  if (*StrB)
-    return -1;
-  return 0;
+int launchJob(Job *J, Command *Cmd, Shell *S, int InFD, int OutFD,
+              int ErrFD) {
+  int PipeSize = Cmd->Next != NULL ? getPipeSize(S) : 0;
+  int NumLaunched = 0;
+  for (Command *Stage = Cmd; Stage != NULL; Stage = Stage->Next) {
+    int Pipe[2] = {-1, OutFD};
+    if (Stage->Next != NULL) {
+      if (pipe2(Pipe, O_CLOEXEC) == -1) {
+        perror("pipe");
+        break;
+      }
+      if (PipeSize > 0 && fcntl(Pipe[1], F_SETPIPE_SZ, PipeSize) == -1)
+        perror("fcntl");
+    }
+    J->Procs[NumLaunched].PID = launchStage(Stage, S, InFD, Pipe[1], ErrFD);
+    if (J->Procs[NumLaunched].PID > 0)
+      watchJobProcess(&J->Procs[NumLaunched], S->Jobs);
+    NumLaunched++;
+    if (InFD != -1)
+      close(InFD);
+    if (Pipe[1] != -1 && Pipe[1] != OutFD)
+      close(Pipe[1]);
+    InFD = Pipe[0];
+  }
+  if (InFD != -1)
+    close(InFD);
+  return NumLaunched;
 }
 
-int filterDirDotFiles(const struct dirent *Entry) {
-  return Entry->d_name[0] != '.';
+int executePipeline(Command *Cmd, Shell *S, const char *Line, size_t Len) {
+  int NumStages = 0;
+  for (Command *Stage = Cmd; Stage != NULL; Stage = Stage->Next)
+    NumStages++;
+  Job *J = initJob(NumStages, Line, Len);
+  if (J == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  flushShellOutput(S);
+  int InFD = -1;
+  if (Cmd->Background && (InFD = open("/dev/null", O_RDONLY | O_CLOEXEC)) == -1)
+    perror("open");
+  launchJob(J, Cmd, S, InFD, -1, -1);
+  if (Cmd->Background && addJob(J, S->Jobs) == 0) {
+    if (S->Interactive)
+      writeFormat(S->Err, "[%d] %d\n", J->ID,
+                  (int)J->Procs[NumStages - 1].PID);
+    return 0;
+  }
+  double Start = getTime();
+  int Status = waitJob(J, S->Jobs);
+  recordLatency(&S->Stats.Wait, Start, getTime());
+  endSpan(S, "wait", Start);
+  getJobUsage(J, &S->LastUsage);
+  if (Cmd->Timed || isTimeAll(S))
+    reportUsage(S, &S->LastUsage, Cmd->Timed ? NULL : J->Line);
+  freeJob(J);
+  return Status;
 }
 
 int execute(Command *Cmd, Shell *S) {
   if (Cmd == NULL || Cmd->TokenCount == 0 || S == NULL)
     return 1;
   BuiltinCommandInfo *BC = getBuiltinCommandInfo(Cmd);
-  if (BC == NULL) {
-    Command *CmdCpy = getCommandCopy(Cmd);
-    addHistory(S->Hist, CmdCpy);
-    if (Cmd->Redirection && Cmd->Redirection->File &&
-        Cmd->Redirection->Mode != RedirectNone) {
-      free(Cmd->Tokens[Cmd->TokenCount - 1]);
-      Cmd->Tokens[--Cmd->TokenCount] = NULL;
-    }
-    replaceVariables(Cmd, S->VA, 0);
-    pid_t PID = fork();
-    if (PID == -1) {
-      perror("fork");
-      return 1;
-    }
-    if (PID == 0) {
-      char *ExecutablePath = findExecutable(Cmd->Tokens[0]);
-      if (ExecutablePath == NULL) {
-        fprintf(stderr, "command not found: %s\n", Cmd->Tokens[0]);
-        freeShell(S);
-        freeCommand(Cmd);
-        exit(1);
-      }
-      if (!redirect(Cmd->Redirection)) {
-        freeShell(S);
-        freeCommand(Cmd);
-        exit(1);
-      }
-      execv(ExecutablePath, Cmd->Tokens);
-      perror("execv");
-      exit(1);
-    } else {
-      int Status;
-      waitpid(PID, &Status, 0);
-
-      if (WIFEXITED(Status))
-        return WEXITSTATUS(Status);
-      else
-        return 1;
-    }
+  ArenaMark Mark = getArenaMark(S->Arena);
+  double CommandStart = getTime();
+  int Status = 1;
+  if (BC == NULL || Cmd->Next != NULL || Cmd->Background) {
+    size_t Len;
+    char *Line = getCommandLine(Cmd, S->Arena, &Len);
+    addHistory(S->Hist, Line, Len);
+    Status = executePipeline(Cmd, S, Line, Len);
   } else {
     int CheckFirstVar = strcmp(BC->Name, "local") == 0    ? 1
                         : strcmp(BC->Name, "export") == 0 ? 2
                                                           : 0;
-    int Err = replaceVariables(Cmd, S->VA, CheckFirstVar);
-    if (CheckFirstVar && Err)
-      return 1;
-    if (Cmd->Redirection && Cmd->Redirection->File &&
-        Cmd->Redirection->Mode != RedirectNone) {
-      free(Cmd->Tokens[Cmd->TokenCount - 1]);
-      Cmd->Tokens[--Cmd->TokenCount] = NULL;
-    }
-    if (Cmd->Redirection)
-      if (!redirect(Cmd->Redirection)) {
-        freeCommand(Cmd);
-        return 1;
+    S->SubstitutionStatus = -1;
+    double Start = startSpan(S);
+    Command *Expanded = replaceVariables(Cmd, S, CheckFirstVar);
+    endSpan(S, "expand", Start);
+    SavedFD Saved[2];
+    if (Expanded != NULL && Expanded->Redirection != NULL)
+      flushShellOutput(S);
+    int NumSaved =
+        Expanded == NULL ? -1 : redirect(Expanded->Redirection, Saved, S->Err);
+    if (NumSaved != -1) {
+      struct rusage Before;
+      double Start = 0;
+      if (Cmd->Timed) {
+        getrusage(RUSAGE_SELF, &Before);
+        Start = getTime();
       }
-    return BC->Func(Cmd, S);
+      double SpanStart = startSpan(S);
+      Status = BC->Func(Expanded, S);
+      endSpan(S, "builtin", SpanStart);
+      if (Status == 0 && CheckFirstVar != 0 && S->SubstitutionStatus != -1)
+        Status = S->SubstitutionStatus;
+      if (Cmd->Timed)
+        measureBuiltin(S, Start, &Before);
+      if (NumSaved > 0)
+        flushShellOutput(S);
+      restoreRedirect(Saved, NumSaved);
+    }
   }
-  return 0;
+  S->Stats.Commands++;
+  recordLatency(&S->Stats.Command, CommandStart, getTime());
+  releaseArena(S->Arena, Mark);
+  return Status;
+}
+
+void measureBuiltin(Shell *S, double Start, const struct rusage *Before) {
+  struct rusage After;
+  getrusage(RUSAGE_SELF, &After);
+  ResourceUsage *U = &S->LastUsage;
+  U->Real = getTime() - Start;
+  U->User = getTimevalSeconds(After.ru_utime) -
+            getTimevalSeconds(Before->ru_utime);
+  U->Sys = getTimevalSeconds(After.ru_stime) -
+           getTimevalSeconds(Before->ru_stime);
+  U->MaxRSS = After.ru_maxrss;
+  U->VoluntarySwitches = After.ru_nvcsw - Before->ru_nvcsw;
+  U->InvoluntarySwitches = After.ru_nivcsw - Before->ru_nivcsw;
+  reportUsage(S, U, NULL);
 }
 
 int executeExitCommand(Command *Cmd, Shell *S) {
+  (void)Cmd;
   int Error = S->Error;
-  freeCommand(Cmd);
   freeShell(S);
   exit(-Error);
 }
@@ -653,13 +4392,16 @@ int executeCdCommand(Command *Cmd, Shell *S) {
   if (Cmd == NULL || S == NULL)
     return 1;
   if (Cmd->TokenCount != 2) {
-    fprintf(stderr, "cd: usage: 'cd <dir>'\n");
+    writeFormat(S->Err, "cd: usage: 'cd <dir>'\n");
     return 1;
   }
   if (chdir(Cmd->Tokens[1]) != 0) {
-    fprintf(stderr, "cd: cannot change to directory '%s'\n", Cmd->Tokens[1]);
+    writeFormat(S->Err, "cd: cannot change to directory '%s'\n",
+                Cmd->Tokens[1]);
     return 1;
   }
+  if (S->Cache->Relative)
+    clearExecutableCache(S->Cache);
   return 0;
 }
 
@@ -667,19 +4409,22 @@ int executeExportCommand(Command *Cmd, Shell *S) {
   if (Cmd == NULL || S == NULL)
     return 1;
   if (Cmd->TokenCount != 2) {
-    fprintf(stderr, "export: usage: 'export S->VAR=<value>'\n");
+    writeFormat(S->Err, "export: usage: 'export S->VAR=<value>'\n");
     return 1;
   }
-  char *name = strtok(Cmd->Tokens[1], "=");
-  if (name == NULL)
+  char *Value = strchr(Cmd->Tokens[1], '=');
+  if (Value == Cmd->Tokens[1])
     return 1;
-  char *value = strtok(NULL, "=");
-  if (value == NULL) {
-    fprintf(stderr, "export: variable must have definition\n");
+  if (Value == NULL || Value[1] == '\0') {
+    writeFormat(S->Err, "export: variable must have definition\n");
     return 1;
   }
-  if (setenv(name, value, 1) < 0)
+  char *name =
+      arenaStrndup(S->Arena, Cmd->Tokens[1], Value - Cmd->Tokens[1]);
+  if (setEnvironmentVariable(S->VA, name, Value + 1))
     return 1;
+  if (strcmp(name, "PATH") == 0)
+    clearExecutableCache(S->Cache);
   return 0;
 }
 
@@ -687,60 +4432,28 @@ int executeLocalCommand(Command *Cmd, Shell *S) {
   if (Cmd == NULL || S == NULL)
     return 1;
   if (Cmd->TokenCount != 2) {
-    fprintf(stderr, "local: usage: 'local S->VAR=<value>'\n");
-    return 1;
-  }
-  char *TokenCopy = strdup(Cmd->Tokens[1]);
-  if (!TokenCopy) {
-    perror("strdup");
-    return 1;
-  }
-  char *Name = strtok(TokenCopy, "=");
-  if (Name == NULL) {
-    free(TokenCopy);
-    fprintf(stderr, "local: usage: 'local S->VAR=<value>'\n");
-    return 1;
-  }
-  char *Value = strtok(NULL, "=");
-  LocalVariable *Var = (LocalVariable *)malloc(sizeof(LocalVariable));
-  if (!Var) {
-    free(TokenCopy);
-    return 1;
-  }
-  Var->Name = strdup(Name);
-  if (Var->Name == NULL) {
-    free(Var);
-    free(TokenCopy);
-    perror("strdup");
+    writeFormat(S->Err, "local: usage: 'local S->VAR=<value>'\n");
     return 1;
   }
-  Var->Value = Value == NULL ? strdup("") : strdup(Value);
-  if (Var->Value == NULL) {
-    free(Var->Name);
-    free(Var);
-    free(TokenCopy);
-    perror("strdup");
+  char *Name = Cmd->Tokens[1];
+  char *Value = strchr(Name, '=');
+  size_t NameLen = Value == NULL ? strlen(Name) : (size_t)(Value - Name);
+  if (NameLen == 0) {
+    writeFormat(S->Err, "local: usage: 'local S->VAR=<value>'\n");
     return 1;
   }
-  free(TokenCopy);
-  LocalVariable *ExistingVar = getLocalVariable(Var->Name, S->VA);
-  if (ExistingVar == NULL)
-    addLocalVariable(S->VA, Var);
-  else
-    updateLocalVariable(S->VA, Var);
-  return 0;
+  return setLocalVariable(S->VA, Name, NameLen, Value == NULL ? "" : Value + 1);
 }
 
 int executeVarsCommand(Command *Cmd, Shell *S) {
   if (Cmd == NULL || S == NULL)
     return 1;
   if (Cmd->TokenCount != 1) {
-    fprintf(stderr, "vars: usage: 'vars'\n");
+    writeFormat(S->Err, "vars: usage: 'vars'\n");
     return 1;
   }
   for (int i = 0; i < S->VA->Count; i++)
-    if (S->VA->Vars[i]->Name != NULL && S->VA->Vars[i]->Value != NULL)
-      printf("%s=%s\n", S->VA->Vars[i]->Name, S->VA->Vars[i]->Value);
+    writeFormat(S->Out, "%s=%s\n", S->VA->Vars[i]->Name, S->VA->Vars[i]->Value);
   return 0;
 }
 
@@ -750,41 +4463,42 @@ int executeHistoryCommand(Command *Cmd, Shell *S) {
   History *Hist = S->Hist;
   if (Hist == NULL)
     return 1;
+  if (Cmd->TokenCount >= 2 && strcmp(Cmd->Tokens[1], "search") == 0)
+    return searchHistory(Cmd, S);
   switch (Cmd->TokenCount) {
   default:
-    fprintf(stderr, "history: incorrect usage\n");
+    writeFormat(S->Err, "history: incorrect usage\n");
     return 1;
   case 1: {
-    for (int i = 1; i <= Hist->Count; i++) {
-      printf("%d) ", i);
-      Command *Temp = getHistory(i, Hist);
-      printCommand(Temp);
-      freeCommand(Temp);
-    }
+    for (int i = 1; i <= Hist->Count; i++)
+      writeFormat(S->Out, "%d) %s\n", i, getHistory(i, Hist));
   } break;
   case 2: {
     char *EndPtr;
     int NumEntry = (int)strtol(Cmd->Tokens[1], &EndPtr, 0);
     if (Cmd->Tokens[1] == EndPtr) {
-      fprintf(stderr, "history: usage: 'history <n>'\n");
+      writeFormat(S->Err, "history: usage: 'history <n>'\n");
       return 1;
     }
-    Command *NextCmd = getHistory(NumEntry, Hist);
+    const char *Line = getHistory(NumEntry, Hist);
+    if (Line == NULL)
+      return 1;
+    Command *NextCmd = parseLine(S, Line, strlen(Line));
     return NextCmd == NULL ? 1 : execute(NextCmd, S);
   } break;
   case 3: {
     if (strcmp(Cmd->Tokens[1], "set")) {
-      fprintf(stderr, "history: usage: 'history set <n>'\n");
+      writeFormat(S->Err, "history: usage: 'history set <n>'\n");
       return 1;
     }
     char *EndPtr;
     int Capacity = (int)strtol(Cmd->Tokens[2], &EndPtr, 0);
     if (Cmd->Tokens[2] == EndPtr) {
-      fprintf(stderr, "history: usage: 'history set <n>'\n");
+      writeFormat(S->Err, "history: usage: 'history set <n>'\n");
       return 1;
     }
     if (Capacity < 1) {
-      fprintf(stderr, "history: minimum history is 1\n");
+      writeFormat(S->Err, "history: minimum history is 1\n");
       return 1;
     }
     return setHistoryCapacity(Capacity, Hist);
@@ -793,24 +4507,765 @@ int executeHistoryCommand(Command *Cmd, Shell *S) {
   return 0;
 }
 
+int searchHistory(Command *Cmd, Shell *S) {
+  if (Cmd->TokenCount < 3) {
+    writeFormat(S->Err, "history: usage: 'history search <pattern>'\n");
+    return 1;
+  }
+  size_t Len = Cmd->TokenCount - 3;
+  for (int i = 2; i < Cmd->TokenCount; i++)
+    Len += strlen(Cmd->Tokens[i]);
+  char *Pattern = (char *)arenaAlloc(S->Arena, Len + 1);
+  char *Out = Pattern;
+  for (int i = 2; i < Cmd->TokenCount; i++) {
+    if (i > 2)
+      *Out++ = ' ';
+    Out = stpcpy(Out, Cmd->Tokens[i]);
+  }
+  HistoryIndex *Index = getHistoryIndex(S->Hist);
+  if (Index == NULL)
+    return 1;
+  History *Seen = initHistory(1);
+  if (Seen == NULL)
+    return 1;
+  int Found = 0;
+  for (int ID = findHistoryMatch(Index, Pattern, Len, Index->Count); ID != -1;
+       ID = findHistoryMatch(Index, Pattern, Len, ID)) {
+    size_t LineLen;
+    const char *Line = getHistoryIndexLine(Index, ID, &LineLen);
+    HistoryEntry *Entry = internHistoryEntry(Line, LineLen, Seen);
+    if (Entry == NULL || Entry->RefCount > 1)
+      continue;
+    writeFormat(S->Out, "%s\n", Line);
+    Found = 1;
+  }
+  freeHistory(Seen);
+  return !Found;
+}
+
 int executeLsCommand(Command *Cmd, Shell *S) {
+  if (Cmd == NULL || S == NULL)
+    return 1;
+  int Sort = 1;
+  int Long = 0;
+  const char *Path = NULL;
+  for (int i = 1; i < Cmd->TokenCount; i++) {
+    const char *Arg = Cmd->Tokens[i];
+    if (Arg[0] != '-' || Arg[1] == '\0') {
+      if (Path != NULL) {
+        writeFormat(S->Err, "ls: usage: 'ls [-lU] [dir]'\n");
+        return 1;
+      }
+      Path = Arg;
+      continue;
+    }
+    for (Arg++; *Arg != '\0'; Arg++) {
+      if (*Arg == 'U') {
+        Sort = 0;
+      } else if (*Arg == 'l') {
+        Long = 1;
+      } else {
+        writeFormat(S->Err, "ls: usage: 'ls [-lU] [dir]'\n");
+        return 1;
+      }
+    }
+  }
+  if (Path == NULL)
+    Path = ".";
+  int DirFD = open(Path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (DirFD == -1) {
+    writeFormat(S->Err, "ls: %s: %s\n", Path, strerror(errno));
+    return 1;
+  }
+  int Status = !Sort && !Long
+                   ? streamDirectory(DirFD, S->Out)
+                   : listDirectory(DirFD, Sort, Long, S->Out, S->Arena);
+  close(DirFD);
+  return Status;
+}
+
+int executeJobsCommand(Command *Cmd, Shell *S) {
   if (Cmd == NULL || S == NULL)
     return 1;
   if (Cmd->TokenCount != 1) {
-    fprintf(stderr, "ls: usage: 'ls'\n");
+    writeFormat(S->Err, "jobs: usage: 'jobs'\n");
+    return 1;
+  }
+  JobTable *JT = S->Jobs;
+  while (JT->Count > 0 && pollJobs(JT, 0) == MAX_JOB_EVENTS)
+    ;
+  for (int i = 0; i < JT->Count;) {
+    Job *J = JT->Jobs[i];
+    writeFormat(S->Out, "[%d] %s\t%s\n", J->ID,
+                J->NumRunning > 0 ? "Running" : "Done", J->Line);
+    if (J->NumRunning > 0)
+      i++;
+    else
+      removeJob(i, JT);
+  }
+  return 0;
+}
+
+int executeWaitCommand(Command *Cmd, Shell *S) {
+  if (Cmd == NULL || S == NULL)
+    return 1;
+  JobTable *JT = S->Jobs;
+  if (Cmd->TokenCount == 1) {
+    while (JT->Count > 0) {
+      waitJob(JT->Jobs[0], JT);
+      removeJob(0, JT);
+    }
+    return 0;
+  }
+  int Status = 0;
+  for (int i = 1; i < Cmd->TokenCount; i++) {
+    int Index = findJob(Cmd->Tokens[i], JT);
+    if (Index == -1) {
+      writeFormat(S->Err, "wait: %s: no such job\n", Cmd->Tokens[i]);
+      Status = 127;
+      continue;
+    }
+    Status = waitJob(JT->Jobs[Index], JT);
+    removeJob(Index, JT);
+  }
+  return Status;
+}
+
+int executeFgCommand(Command *Cmd, Shell *S) {
+  if (Cmd == NULL || S == NULL)
+    return 1;
+  if (Cmd->TokenCount > 2) {
+    writeFormat(S->Err, "fg: usage: 'fg [job]'\n");
+    return 1;
+  }
+  JobTable *JT = S->Jobs;
+  int Index =
+      Cmd->TokenCount == 1 ? JT->Count - 1 : findJob(Cmd->Tokens[1], JT);
+  if (Index < 0) {
+    writeFormat(S->Err, "fg: %s: no such job\n",
+                Cmd->TokenCount == 1 ? "current" : Cmd->Tokens[1]);
+    return 1;
+  }
+  const char *Line = JT->Jobs[Index]->Line;
+  size_t Len = strlen(Line);
+  if (Len >= 2 && strcmp(Line + Len - 2, " &") == 0)
+    Len -= 2;
+  writeFormat(S->Out, "%.*s\n", (int)Len, Line);
+  flushWriter(S->Out);
+  int Status = waitJob(JT->Jobs[Index], JT);
+  removeJob(Index, JT);
+  return Status;
+}
+
+int executeTimeCommand(Command *Cmd, Shell *S) {
+  if (Cmd == NULL || S == NULL)
+    return 1;
+  reportUsage(S, &S->LastUsage, NULL);
+  return 0;
+}
+
+int executeStatsCommand(Command *Cmd, Shell *S) {
+  if (Cmd == NULL || S == NULL)
+    return 1;
+  int JSON = 0;
+  int Reset = 0;
+  for (int i = 1; i < Cmd->TokenCount; i++) {
+    const char *Arg = Cmd->Tokens[i];
+    if (Arg[0] != '-' || Arg[1] == '\0') {
+      writeFormat(S->Err, "stats: usage: 'stats [-jr]'\n");
+      return 1;
+    }
+    for (Arg++; *Arg != '\0'; Arg++) {
+      if (*Arg == 'j') {
+        JSON = 1;
+      } else if (*Arg == 'r') {
+        Reset = 1;
+      } else {
+        writeFormat(S->Err, "stats: usage: 'stats [-jr]'\n");
+        return 1;
+      }
+    }
+  }
+  if (Reset && !JSON) {
+    resetStats(S);
+    return 0;
+  }
+  ShellStats *St = &S->Stats;
+  double Elapsed = getTime() - St->Since;
+  if (JSON) {
+    writeFormat(S->Out,
+                "{\"elapsed\": %.6f, \"commands\": %lu, \"forks\": %lu, "
+                "\"path_probes\": %lu, \"cache_hits\": %lu, "
+                "\"cache_misses\": %lu, \"parses\": %lu, "
+                "\"parse_allocs\": %lu, \"parse_bytes\": %zu, "
+                "\"var_lookups\": %lu, \"latency\": {",
+                Elapsed, St->Commands, St->Forks, S->Cache->Probes,
+                S->Cache->Hits, S->Cache->Misses, St->Parses,
+                St->ParseAllocs, St->ParseBytes, S->VA->Lookups);
+    writeLatencyHistogramJSON(S->Out, "command", &St->Command);
+    writeFormat(S->Out, ", ");
+    writeLatencyHistogramJSON(S->Out, "lookup", &St->Lookup);
+    writeFormat(S->Out, ", ");
+    writeLatencyHistogramJSON(S->Out, "spawn", &St->Spawn);
+    writeFormat(S->Out, ", ");
+    writeLatencyHistogramJSON(S->Out, "wait", &St->Wait);
+    writeFormat(S->Out, "}}\n");
+    if (Reset)
+      resetStats(S);
+    return 0;
+  }
+  writeFormat(S->Out, "elapsed      %.3fs\n", Elapsed);
+  writeFormat(S->Out, "commands     %lu\n", St->Commands);
+  writeFormat(S->Out, "forks        %lu\n", St->Forks);
+  writeFormat(S->Out, "path probes  %lu\n", S->Cache->Probes);
+  writeFormat(S->Out, "cache hits   %lu\n", S->Cache->Hits);
+  writeFormat(S->Out, "cache misses %lu\n", S->Cache->Misses);
+  writeFormat(S->Out, "parses       %lu (%lu allocs, %zu bytes)\n",
+              St->Parses, St->ParseAllocs, St->ParseBytes);
+  writeFormat(S->Out, "var lookups  %lu\n", S->VA->Lookups);
+  writeFormat(S->Out, "%-8s %10s %10s %10s %10s %10s %10s\n", "latency",
+              "count", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+  writeLatencyHistogram(S->Out, "command", &St->Command);
+  writeLatencyHistogram(S->Out, "lookup", &St->Lookup);
+  writeLatencyHistogram(S->Out, "spawn", &St->Spawn);
+  writeLatencyHistogram(S->Out, "wait", &St->Wait);
+  return 0;
+}
+
+int executeHashCommand(Command *Cmd, Shell *S) {
+  if (Cmd == NULL || S == NULL)
+    return 1;
+  ExecutableCache *Cache = S->Cache;
+  if (Cmd->TokenCount == 1) {
+    if (Cache->Count == 0) {
+      writeFormat(S->Out, "hash: hash table empty\n");
+      return 0;
+    }
+    writeFormat(S->Out, "hits\tcommand\n");
+    for (int i = 0; i < Cache->Capacity; i++)
+      if (Cache->Entries[i].Name != NULL)
+        writeFormat(S->Out, "%4d\t%s\n", Cache->Entries[i].Hits,
+                    Cache->Entries[i].Path);
+    return 0;
+  }
+  int First = 1;
+  if (strcmp(Cmd->Tokens[1], "-r") == 0) {
+    clearExecutableCache(Cache);
+    First = 2;
+  }
+  int Error = 0;
+  for (int i = First; i < Cmd->TokenCount; i++) {
+    if (strchr(Cmd->Tokens[i], '/') != NULL)
+      continue;
+    char *Path = searchPath(Cmd->Tokens[i], Cache);
+    if (Path == NULL) {
+      writeFormat(S->Err, "hash: %s: not found\n", Cmd->Tokens[i]);
+      Error = 1;
+      continue;
+    }
+    if (addCachedExecutable(Cmd->Tokens[i], Path, Cache) == NULL)
+      Error = 1;
+    free(Path);
+  }
+  return Error;
+}
+
+int executeBuiltinCommand(Command *Cmd, Shell *S) {
+  if (Cmd == NULL || S == NULL)
+    return 1;
+  if (Cmd->TokenCount < 2) {
+    writeFormat(S->Err, "builtin: usage: 'builtin <command> [args]'\n");
+    return 1;
+  }
+  Command Shifted = *Cmd;
+  Shifted.Tokens++;
+  Shifted.TokenCount--;
+  Shifted.External = 0;
+  BuiltinCommandInfo *BC = getBuiltinCommandInfo(&Shifted);
+  if (BC == NULL) {
+    writeFormat(S->Err, "builtin: %s: not a shell builtin\n",
+                Shifted.Tokens[0]);
     return 1;
   }
-  struct dirent **NameList;
-  int NumEntries = scandir(".", &NameList, filterDirDotFiles, alphasort);
-  if (NumEntries < 0) {
-    perror("scandir");
+  return BC->Func(&Shifted, S);
+}
+
+int executeEchoCommand(Command *Cmd, Shell *S) {
+  if (Cmd == NULL || S == NULL)
+    return 1;
+  int Newline = 1;
+  int Escapes = 0;
+  int i = 1;
+  for (; i < Cmd->TokenCount; i++) {
+    const char *Arg = Cmd->Tokens[i];
+    if (Arg[0] != '-' || Arg[1] == '\0' ||
+        Arg[1 + strspn(Arg + 1, "neE")] != '\0')
+      break;
+    for (Arg++; *Arg != '\0'; Arg++) {
+      if (*Arg == 'n')
+        Newline = 0;
+      else
+        Escapes = *Arg == 'e';
+    }
+  }
+  for (int First = i; i < Cmd->TokenCount; i++) {
+    if (i > First)
+      writeBytes(S->Out, " ", 1);
+    if (!Escapes)
+      writeBytes(S->Out, Cmd->Tokens[i], strlen(Cmd->Tokens[i]));
+    else if (writeEscaped(S->Out, Cmd->Tokens[i], 1))
+      return 0;
+  }
+  if (Newline)
+    writeBytes(S->Out, "\n", 1);
+  return 0;
+}
+
+int executeTrueCommand(Command *Cmd, Shell *S) {
+  (void)Cmd;
+  (void)S;
+  return 0;
+}
+
+int executeFalseCommand(Command *Cmd, Shell *S) {
+  (void)Cmd;
+  (void)S;
+  return 1;
+}
+
+int executeTestCommand(Command *Cmd, Shell *S) {
+  if (Cmd == NULL || S == NULL)
+    return 2;
+  TestParser P = {Cmd->Tokens + 1, 0, Cmd->TokenCount - 1, S, 0};
+  if (strcmp(Cmd->Tokens[0], "[") == 0) {
+    if (P.Count == 0 || strcmp(P.Argv[P.Count - 1], "]") != 0) {
+      writeFormat(S->Err, "[: missing ']'\n");
+      return 2;
+    }
+    P.Count--;
+  }
+  if (P.Count == 0)
     return 1;
+  int Result = parseTestOr(&P);
+  if (!P.Error && P.Pos < P.Count) {
+    writeFormat(S->Err, "test: %s: unexpected argument\n", P.Argv[P.Pos]);
+    P.Error = 1;
+  }
+  return P.Error ? 2 : !Result;
+}
+
+int parseTestOr(TestParser *P) {
+  int Result = parseTestAnd(P);
+  while (P->Pos < P->Count && strcmp(P->Argv[P->Pos], "-o") == 0) {
+    P->Pos++;
+    int Right = parseTestAnd(P);
+    Result = Result || Right;
+  }
+  return Result;
+}
+
+int parseTestAnd(TestParser *P) {
+  int Result = parseTestNot(P);
+  while (P->Pos < P->Count && strcmp(P->Argv[P->Pos], "-a") == 0) {
+    P->Pos++;
+    int Right = parseTestNot(P);
+    Result = Result && Right;
+  }
+  return Result;
+}
+
+int parseTestNot(TestParser *P) {
+  int Left = P->Count - P->Pos;
+  if (Left >= 2 && strcmp(P->Argv[P->Pos], "!") == 0 &&
+      (Left < 3 || !isTestBinaryOperator(P->Argv[P->Pos + 1]))) {
+    P->Pos++;
+    return !parseTestNot(P);
+  }
+  return parseTestPrimary(P);
+}
+
+int parseTestPrimary(TestParser *P) {
+  if (P->Pos >= P->Count) {
+    writeFormat(P->S->Err, "test: argument expected\n");
+    P->Error = 1;
+    return 0;
+  }
+  char **Argv = P->Argv + P->Pos;
+  int Left = P->Count - P->Pos;
+  if (Left >= 3 && isTestBinaryOperator(Argv[1])) {
+    P->Pos += 3;
+    return evaluateTestBinary(P, Argv[0], Argv[1], Argv[2]);
+  }
+  if (Left >= 2 && strcmp(Argv[0], "(") == 0) {
+    P->Pos++;
+    int Result = parseTestOr(P);
+    if (P->Pos >= P->Count || strcmp(P->Argv[P->Pos], ")") != 0) {
+      if (!P->Error)
+        writeFormat(P->S->Err, "test: missing ')'\n");
+      P->Error = 1;
+      return 0;
+    }
+    P->Pos++;
+    return Result;
+  }
+  if (Left >= 2) {
+    int Result = evaluateTestUnary(Argv[0], Argv[1]);
+    if (Result != -1) {
+      P->Pos += 2;
+      return Result;
+    }
+  }
+  P->Pos++;
+  return Argv[0][0] != '\0';
+}
+
+int isTestBinaryOperator(const char *Op) {
+  for (int i = 0; i < NumTestBinaryOperators; i++)
+    if (strcmp(Op, TestBinaryOperators[i]) == 0)
+      return 1;
+  return 0;
+}
+
+int evaluateTestUnary(const char *Op, const char *Arg) {
+  if (Op[0] != '-' || Op[1] == '\0' || Op[2] != '\0' ||
+      strchr("nzrwxefdsLhpSbc", Op[1]) == NULL)
+    return -1;
+  switch (Op[1]) {
+  case 'n':
+    return Arg[0] != '\0';
+  case 'z':
+    return Arg[0] == '\0';
+  case 'r':
+    return access(Arg, R_OK) == 0;
+  case 'w':
+    return access(Arg, W_OK) == 0;
+  case 'x':
+    return access(Arg, X_OK) == 0;
+  }
+  struct stat St;
+  int Link = Op[1] == 'L' || Op[1] == 'h';
+  if ((Link ? lstat(Arg, &St) : stat(Arg, &St)) != 0)
+    return 0;
+  switch (Op[1]) {
+  case 'f':
+    return S_ISREG(St.st_mode);
+  case 'd':
+    return S_ISDIR(St.st_mode);
+  case 's':
+    return St.st_size > 0;
+  case 'L':
+  case 'h':
+    return S_ISLNK(St.st_mode);
+  case 'p':
+    return S_ISFIFO(St.st_mode);
+  case 'S':
+    return S_ISSOCK(St.st_mode);
+  case 'b':
+    return S_ISBLK(St.st_mode);
+  case 'c':
+    return S_ISCHR(St.st_mode);
   }
+  return 1;
+}
+
+int evaluateTestBinary(TestParser *P, const char *Left, const char *Op,
+                       const char *Right) {
+  if (Op[0] != '-')
+    return (strcmp(Left, Right) == 0) == (Op[0] != '!');
+  long long A, B;
+  if (parseTestInteger(P, Left, &A) || parseTestInteger(P, Right, &B))
+    return 0;
+  if (strcmp(Op, "-eq") == 0)
+    return A == B;
+  if (strcmp(Op, "-ne") == 0)
+    return A != B;
+  if (strcmp(Op, "-lt") == 0)
+    return A < B;
+  if (strcmp(Op, "-le") == 0)
+    return A <= B;
+  if (strcmp(Op, "-gt") == 0)
+    return A > B;
+  return A >= B;
+}
 
-  for (int i = 0; i < NumEntries; i++) {
-    printf("%s\n", NameList[i]->d_name);
-    free(NameList[i]);
+int parseTestInteger(TestParser *P, const char *Str, long long *Value) {
+  char *End;
+  errno = 0;
+  *Value = strtoll(Str, &End, 10);
+  if (End == Str || *End != '\0' || errno == ERANGE) {
+    writeFormat(P->S->Err, "test: %s: integer expression expected\n", Str);
+    P->Error = 1;
+    return 1;
   }
-  free(NameList);
   return 0;
 }
+
+int executePrintfCommand(Command *Cmd, Shell *S) {
+  if (Cmd == NULL || S == NULL)
+    return 1;
+  if (Cmd->TokenCount < 2) {
+    writeFormat(S->Err, "printf: usage: 'printf <format> [args]'\n");
+    return 1;
+  }
+  const char *Format = Cmd->Tokens[1];
+  int Arg = 2;
+  int Status = 0;
+  for (;;) {
+    int First = Arg;
+    for (const char *P = Format; *P != '\0';) {
+      size_t Len = strcspn(P, "\\%");
+      writeBytes(S->Out, P, Len);
+      P += Len;
+      if (*P == '\\') {
+        int Stop = 0;
+        P = writeEscape(S->Out, P + 1, 0, &Stop);
+        if (Stop)
+          return Status;
+        continue;
+      }
+      if (*P == '\0')
+        break;
+      if (P[1] == '%') {
+        writeBytes(S->Out, "%", 1);
+        P += 2;
+        continue;
+      }
+      const char *Start = P++;
+      char Spec[64];
+      size_t SpecLen = 0;
+      Spec[SpecLen++] = '%';
+      while (*P != '\0' && strchr("-+ #0", *P) != NULL && SpecLen < 8)
+        Spec[SpecLen++] = *P++;
+      int Invalid = 0;
+      for (int Part = 0; Part < 2 && !Invalid; Part++) {
+        if (Part == 1 && *P != '.')
+          break;
+        if (Part == 1)
+          Spec[SpecLen++] = *P++;
+        if (*P == '*') {
+          P++;
+          long long N = 0;
+          double Float;
+          if (Arg < Cmd->TokenCount &&
+              getPrintfArgument(Cmd->Tokens[Arg++], 'd', &N, &Float)) {
+            writeFormat(S->Err, "printf: %s: invalid number\n",
+                        Cmd->Tokens[Arg - 1]);
+            Status = 1;
+          }
+          if (N < INT_MIN || N > INT_MAX)
+            N = 0;
+          if (Part == 1 && N < 0)
+            SpecLen--;
+          else
+            SpecLen += sprintf(Spec + SpecLen, "%d", (int)N);
+          continue;
+        }
+        size_t Digits = strspn(P, "0123456789");
+        Invalid = Digits > 10;
+        if (!Invalid) {
+          memcpy(Spec + SpecLen, P, Digits);
+          SpecLen += Digits;
+        }
+        P += Digits;
+      }
+      if (Invalid || *P == '\0' ||
+          strchr("diouxXcsbqfFeEgGaA", *P) == NULL) {
+        writeFormat(S->Err, "printf: %.*s: invalid format\n",
+                    (int)(P - Start + (*P != '\0')), Start);
+        return 1;
+      }
+      char Conv = *P++;
+      const char *Value = Arg < Cmd->TokenCount ? Cmd->Tokens[Arg++] : "";
+      if (Conv == 'b') {
+        Writer Buffer = {-1, NULL, 0, 0, 0};
+        int Stop = writeEscaped(&Buffer, Value, 1);
+        writeBytes(&Buffer, "", 1);
+        strcpy(Spec + SpecLen, "s");
+        writeFormat(S->Out, Spec, Buffer.Data != NULL ? Buffer.Data : "");
+        free(Buffer.Data);
+        if (Stop)
+          return Status;
+        continue;
+      }
+      if (Conv == 'q') {
+        Writer Buffer = {-1, NULL, 0, 0, 0};
+        writeQuoted(&Buffer, Value);
+        writeBytes(&Buffer, "", 1);
+        strcpy(Spec + SpecLen, "s");
+        writeFormat(S->Out, Spec, Buffer.Data != NULL ? Buffer.Data : "");
+        free(Buffer.Data);
+        continue;
+      }
+      if (Conv == 's' || Conv == 'c') {
+        char Char[2] = {Value[0], '\0'};
+        strcpy(Spec + SpecLen, "s");
+        writeFormat(S->Out, Spec, Conv == 's' ? Value : Char);
+        continue;
+      }
+      long long N = 0;
+      double Float = 0;
+      if (getPrintfArgument(Value, Conv, &N, &Float)) {
+        writeFormat(S->Err, "printf: %s: invalid number\n", Value);
+        Status = 1;
+      }
+      if (strchr("fFeEgGaA", Conv) != NULL) {
+        Spec[SpecLen] = Conv;
+        Spec[SpecLen + 1] = '\0';
+        writeFormat(S->Out, Spec, Float);
+        continue;
+      }
+      Spec[SpecLen] = 'l';
+      Spec[SpecLen + 1] = 'l';
+      Spec[SpecLen + 2] = Conv;
+      Spec[SpecLen + 3] = '\0';
+      writeFormat(S->Out, Spec, N);
+    }
+    if (Arg == First || Arg >= Cmd->TokenCount)
+      break;
+  }
+  return Status;
+}
+
+int getPrintfArgument(const char *Value, char Conv, long long *Int,
+                      double *Float) {
+  if (Value[0] == '\'' || Value[0] == '"') {
+    *Int = (unsigned char)Value[1];
+    *Float = *Int;
+    return 0;
+  }
+  char *End;
+  errno = 0;
+  if (strchr("fFeEgGaA", Conv) != NULL)
+    *Float = strtod(Value, &End);
+  else if (Conv == 'd' || Conv == 'i')
+    *Int = strtoll(Value, &End, 0);
+  else
+    *Int = (long long)strtoull(Value, &End, 0);
+  return *Value != '\0' && (*End != '\0' || errno == ERANGE);
+}
+
+const char *writeEscape(Writer *W, const char *P, int Echo, int *Stop) {
+  static const char Escapes[] = "\\\\a\ab\be\033f\fn\nr\rt\tv\v";
+  if (*P == 'c') {
+    *Stop = 1;
+    return P + 1;
+  }
+  if (*P >= '0' && *P <= '7' && (!Echo || *P == '0')) {
+    P += Echo;
+    int Value = 0;
+    for (int i = 0; i < 3 && *P >= '0' && *P <= '7'; i++, P++)
+      Value = Value * 8 + (*P - '0');
+    char Byte = (char)Value;
+    writeBytes(W, &Byte, 1);
+    return P;
+  }
+  if (*P == 'x' && isxdigit((unsigned char)P[1])) {
+    int Value = 0;
+    P++;
+    for (int i = 0; i < 2 && isxdigit((unsigned char)*P); i++, P++)
+      Value = Value * 16 +
+              (isdigit((unsigned char)*P) ? *P - '0' : (*P | 0x20) - 'a' + 10);
+    char Byte = (char)Value;
+    writeBytes(W, &Byte, 1);
+    return P;
+  }
+  for (const char *E = Escapes; *P != '\0' && *E != '\0'; E += 2) {
+    if (*E == *P) {
+      writeBytes(W, E + 1, 1);
+      return P + 1;
+    }
+  }
+  writeBytes(W, "\\", 1);
+  return P;
+}
+
+void writeQuoted(Writer *W, const char *Str) {
+  if (Str[0] != '\0' &&
+      Str[strspn(Str, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                      "0123456789_./:=@%+,-")] == '\0') {
+    writeBytes(W, Str, strlen(Str));
+    return;
+  }
+  writeBytes(W, "'", 1);
+  for (const char *Quote; (Quote = strchr(Str, '\'')) != NULL;
+       Str = Quote + 1) {
+    writeBytes(W, Str, Quote - Str);
+    writeBytes(W, "'\\''", 4);
+  }
+  writeBytes(W, Str, strlen(Str));
+  writeBytes(W, "'", 1);
+}
+
+int writeEscaped(Writer *W, const char *Str, int Echo) {
+  int Stop = 0;
+  while (*Str != '\0' && !Stop) {
+    size_t Len = strcspn(Str, "\\");
+    writeBytes(W, Str, Len);
+    Str += Len;
+    if (*Str == '\\')
+      Str = writeEscape(W, Str + 1, Echo, &Stop);
+  }
+  return Stop;
+}
+
+int executeCatCommand(Command *Cmd, Shell *S) {
+  if (Cmd == NULL || S == NULL)
+    return 1;
+  int Status = 0;
+  for (int i = 1; i < Cmd->TokenCount || i == 1; i++) {
+    const char *Path = i < Cmd->TokenCount ? Cmd->Tokens[i] : "-";
+    int FD = strcmp(Path, "-") == 0 ? STDIN_FILENO
+                                    : open(Path, O_RDONLY | O_CLOEXEC);
+    struct stat In, Out;
+    if (FD != -1 && S->Out->FD != -1 && fstat(FD, &In) == 0 &&
+        fstat(S->Out->FD, &Out) == 0 && S_ISREG(In.st_mode) &&
+        In.st_dev == Out.st_dev && In.st_ino == Out.st_ino) {
+      writeFormat(S->Err, "cat: %s: input file is output file\n", Path);
+      Status = 1;
+    } else if (FD == -1 || copyToWriter(FD, S->Out)) {
+      writeFormat(S->Err, "cat: %s: %s\n", Path, strerror(errno));
+      Status = 1;
+    }
+    if (FD > STDIN_FILENO)
+      close(FD);
+  }
+  return Status;
+}
+
+int copyToWriter(int FD, Writer *W) {
+  struct stat St;
+  if (W->FD != -1 && fstat(FD, &St) == 0 && S_ISREG(St.st_mode) &&
+      St.st_size > 0) {
+    if (flushWriter(W))
+      return 1;
+    ssize_t N;
+    while ((N = copy_file_range(FD, NULL, W->FD, NULL, COPY_CHUNK_SIZE, 0)) >
+           0)
+      ;
+    if (N == 0)
+      return 0;
+    if (errno != EINVAL && errno != EXDEV && errno != ENOSYS &&
+        errno != EBADF && errno != EOPNOTSUPP)
+      return 1;
+    while ((N = sendfile(W->FD, FD, NULL, COPY_CHUNK_SIZE)) > 0)
+      ;
+    if (N == 0)
+      return 0;
+    if (errno != EINVAL && errno != ENOSYS)
+      return 1;
+  }
+  for (;;) {
+    if (W->Len == W->Capacity &&
+        (W->FD != -1 ? flushWriter(W) : growWriter(W, W->Capacity * 2)))
+      return 1;
+    ssize_t N = read(FD, W->Data + W->Len, W->Capacity - W->Len);
+    if (N == 0)
+      return W->LineBuffered ? flushWriter(W) : 0;
+    if (N == -1) {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    W->Len += N;
+  }
+}
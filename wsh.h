@@ -1,8 +1,13 @@
 #ifndef WSH_H
 #define WSH_H
 
-#include <dirent.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <termios.h>
 
 typedef enum {
   RedirectNone,
@@ -25,87 +30,742 @@ typedef struct {
 } RedirectFlag;
 
 typedef struct {
+  int From;
+  int To;
+} FDMove;
+
+typedef struct {
+  int FD;
+  int Saved;
+} SavedFD;
+
+typedef struct Command {
   char **Tokens;
   int TokenCount;
   Redirect *Redirection;
+  int Background;
+  int Timed;
+  int External;
+  struct Command *Next;
 } Command;
 
+typedef enum {
+  KeywordNone,
+  KeywordIf,
+  KeywordThen,
+  KeywordElif,
+  KeywordElse,
+  KeywordFi,
+  KeywordWhile,
+  KeywordFor,
+  KeywordDo,
+  KeywordDone,
+} BlockKeyword;
+
+typedef enum {
+  NodeCommand,
+  NodeIf,
+  NodeWhile,
+  NodeFor,
+} NodeKind;
+
+typedef struct Node {
+  NodeKind Kind;
+  Command *Cmd;
+  char **Words;
+  int NumWords;
+  struct Node *Body;
+  struct Node *Else;
+  struct Node *Next;
+} Node;
+
+typedef struct {
+  Node *Block;
+  Node **Tail;
+  BlockKeyword Expect;
+  int InElse;
+  int Elif;
+} BlockFrame;
+
+typedef struct {
+  Node *Root;
+  BlockFrame *Frames;
+  int Depth;
+  int Capacity;
+} BlockParser;
+
+typedef struct {
+  int RefCount;
+  unsigned int Hash;
+  size_t Len;
+  char Text[];
+} HistoryEntry;
+
+typedef struct {
+  unsigned int Key;
+  int Count;
+  int Capacity;
+  int *IDs;
+} TrigramPosting;
+
 typedef struct {
-  Command **Entries;
+  char *Text;
+  size_t TextCapacity;
+  size_t *Offsets;
   int Count;
   int Capacity;
+  TrigramPosting *Lists;
+  int NumLists;
+  int ListCapacity;
+} HistoryIndex;
+
+typedef struct {
+  HistoryEntry **Entries;
+  int Head;
+  int Count;
+  int Capacity;
+  HistoryEntry **Pool;
+  int PoolCount;
+  int PoolCapacity;
+  int FD;
+  HistoryIndex *Index;
+  pthread_t IndexThread;
+  pid_t IndexOwner;
+  off_t IndexedSize;
 } History;
 
 typedef struct {
   char *Name;
   char *Value;
+  size_t ValueSize;
+  const char *EnvValue;
+  unsigned int Hash;
 } LocalVariable;
 
 typedef struct {
   LocalVariable **Vars;
   int Count;
   int Capacity;
+  LocalVariable **Table;
+  int NumEntries;
+  int TableCapacity;
+  unsigned long Lookups;
 } LocalVariableArray;
 
+typedef struct {
+  char *Name;
+  char *Path;
+  unsigned int Hash;
+  int Hits;
+} ExecutableEntry;
+
+typedef struct {
+  ExecutableEntry *Entries;
+  int Count;
+  int Capacity;
+  int Relative;
+  unsigned long Probes;
+  unsigned long Hits;
+  unsigned long Misses;
+} ExecutableCache;
+
+typedef struct ArenaBlock {
+  struct ArenaBlock *Prev;
+  size_t Size;
+  size_t Used;
+  char Data[];
+} ArenaBlock;
+
+typedef struct {
+  ArenaBlock *Head;
+  size_t BlockSize;
+  unsigned long NumAllocs;
+  size_t Allocated;
+} Arena;
+
+typedef struct {
+  ArenaBlock *Block;
+  size_t Used;
+} ArenaMark;
+
+typedef struct {
+  Arena *A;
+  char *Data;
+  size_t Len;
+  size_t Capacity;
+} StringBuilder;
+
+typedef struct {
+  int FD;
+  char *Map;
+  char *Buffer;
+  size_t Capacity;
+  size_t Start;
+  size_t End;
+  int Eof;
+  int Shared;
+  int Seekable;
+  off_t Offset;
+} LineReader;
+
+typedef struct {
+  int FD;
+  char *Buffer;
+  size_t Len;
+  size_t Capacity;
+  const char *Prompt;
+  struct termios Original;
+} LineEditor;
+
+typedef struct {
+  struct Job *Job;
+  pid_t PID;
+  int PIDFD;
+  int Status;
+  struct rusage Usage;
+} JobProcess;
+
+typedef struct Job {
+  int ID;
+  int NumProcs;
+  int NumRunning;
+  char *Line;
+  double StartTime;
+  double EndTime;
+  JobProcess Procs[];
+} Job;
+
+typedef struct {
+  Job **Jobs;
+  int Count;
+  int Capacity;
+  int EpollFD;
+  int SignalFD;
+  JobProcess **Table;
+  int NumEntries;
+  int TableCapacity;
+} JobTable;
+
+typedef struct {
+  int FD;
+  char *Data;
+  size_t Len;
+  size_t Capacity;
+} CaptureBuffer;
+
+typedef struct {
+  Job *Job;
+  CaptureBuffer Output[2];
+  int Timed;
+  int TimeAll;
+} ParallelLine;
+
+typedef struct {
+  ParallelLine *Lines;
+  int Head;
+  int Count;
+  int Capacity;
+  int Running;
+  int EpollFD;
+} ParallelRunner;
+
+typedef struct {
+  int FD;
+  char *Data;
+  size_t Len;
+  size_t Capacity;
+  int LineBuffered;
+} Writer;
+
+typedef struct {
+  uint64_t Inode;
+  int64_t Offset;
+  unsigned short RecLen;
+  unsigned char Type;
+  char Name[];
+} LinuxDirent64;
+
+typedef struct {
+  uint64_t Key;
+  char *Name;
+} DirEntry;
+
+typedef struct {
+  int DirFD;
+  DirEntry *Entries;
+  struct statx *Stats;
+  int Count;
+  int Next;
+} StatBatch;
+
+typedef struct {
+  double Real;
+  double User;
+  double Sys;
+  long MaxRSS;
+  long VoluntarySwitches;
+  long InvoluntarySwitches;
+} ResourceUsage;
+
+typedef struct {
+  const char *Name;
+  int Line;
+  double Start;
+  double Duration;
+} ProfileSpan;
+
+typedef struct {
+  char *Path;
+  ProfileSpan *Spans;
+  int Count;
+  int Capacity;
+  char **Lines;
+  int LinesCapacity;
+  int LineNumber;
+  double Origin;
+} Profiler;
+
+typedef struct {
+  uint32_t Magic;
+  uint32_t Version;
+  uint64_t Size;
+  int64_t MTime;
+  int64_t MTimeNsec;
+  uint64_t Device;
+  uint64_t Inode;
+  uint32_t Path;
+  uint32_t NumLines;
+  uint32_t NumStages;
+  uint32_t NumTokens;
+  uint32_t StringsSize;
+  uint32_t Padding;
+} ScriptCacheHeader;
+
+typedef struct {
+  uint32_t Text;
+  uint32_t TextLen;
+  uint32_t FirstStage;
+  uint32_t NumStages;
+} CachedLine;
+
+typedef struct {
+  uint32_t FirstToken;
+  uint32_t NumTokens;
+  uint32_t RedirectFile;
+  int32_t RedirectFD;
+  uint8_t RedirectMode;
+  uint8_t Background;
+  uint8_t Timed;
+  uint8_t External;
+} CachedStage;
+
+typedef struct {
+  CachedLine *Lines;
+  int NumLines;
+  int LinesCapacity;
+  CachedStage *Stages;
+  int NumStages;
+  int StagesCapacity;
+  uint32_t *Tokens;
+  int NumTokens;
+  int TokensCapacity;
+  char *Strings;
+  int StringsSize;
+  int StringsCapacity;
+} ScriptCompiler;
+
+typedef struct {
+  char *Map;
+  size_t Size;
+  const ScriptCacheHeader *Header;
+  const CachedLine *Lines;
+  Command *Commands;
+  Redirect *Redirects;
+  char **Words;
+} ScriptCache;
+
+#define NUM_LATENCY_BUCKETS 32
+
+typedef struct {
+  unsigned long Count;
+  double Sum;
+  double Max;
+  unsigned long Buckets[NUM_LATENCY_BUCKETS];
+} LatencyHistogram;
+
+typedef struct {
+  unsigned long Commands;
+  unsigned long Forks;
+  unsigned long Parses;
+  unsigned long ParseAllocs;
+  size_t ParseBytes;
+  LatencyHistogram Command;
+  LatencyHistogram Lookup;
+  LatencyHistogram Spawn;
+  LatencyHistogram Wait;
+  double Since;
+} ShellStats;
+
 typedef struct {
   LocalVariableArray *VA;
   History *Hist;
+  ExecutableCache *Cache;
+  Arena *Arena;
+  JobTable *Jobs;
+  Writer *Out;
+  Writer *Err;
+  int Interactive;
+  int Parallelism;
+  int CacheScripts;
+  ResourceUsage LastUsage;
+  Profiler *Prof;
+  BlockParser *Block;
+  ShellStats Stats;
   int Error;
+  int SubstitutionStatus;
+  unsigned long Substitutions;
 } Shell;
 
+typedef enum {
+  ArithNone,
+  ArithOr,
+  ArithAnd,
+  ArithEqual,
+  ArithNotEqual,
+  ArithLessEqual,
+  ArithGreaterEqual,
+  ArithShiftLeft,
+  ArithShiftRight,
+  ArithBitOr,
+  ArithBitXor,
+  ArithBitAnd,
+  ArithLess,
+  ArithGreater,
+  ArithAdd,
+  ArithSubtract,
+  ArithMultiply,
+  ArithDivide,
+  ArithModulo,
+} ArithOperator;
+
+typedef struct {
+  const char *Text;
+  ArithOperator Op;
+  int Prec;
+  int Assignable;
+} ArithOperatorInfo;
+
+typedef struct {
+  const char *Pos;
+  Shell *S;
+  int Skip;
+  const char *Error;
+} ArithParser;
+
+typedef struct {
+  char **Argv;
+  int Pos;
+  int Count;
+  Shell *S;
+  int Error;
+} TestParser;
+
 typedef int (*BuiltinCommandFunc)(Command *, Shell *);
 
+typedef enum {
+  BuiltinMutates,
+  BuiltinReadOnly,
+  BuiltinReadOnlyBare,
+  BuiltinReadsInput,
+} BuiltinEffect;
+
 typedef struct {
   const char *Name;
   BuiltinCommandFunc Func;
+  BuiltinEffect Effect;
 } BuiltinCommandInfo;
 
 extern const BuiltinCommandInfo BuiltinCommandInfoMap[];
 extern const int NumBuiltinCommands;
 extern const RedirectFlag RedirectFlags[];
+extern const char *const RedirectOps[];
+extern const ArithOperatorInfo ArithOperators[];
+extern const int NumArithOperators;
 
 Shell *initShell(void);
 void freeShell(Shell *);
+int initHistoryFile(Shell *, int);
 
 int runInteractiveMode(Shell *);
 int runBatchMode(Shell *, const char *);
+int runParallelBatch(Shell *, LineReader *);
+int runCachedScript(Shell *, ScriptCache *);
+int runCommand(Shell *, Command *);
+void endBlockInput(Shell *);
+
+int compileScript(Shell *, int, const char *, const char *,
+                  const struct stat *);
+char *getScriptCachePath(const char *);
+int reserveArray(void **, int *, int, size_t);
+ScriptCompiler *initScriptCompiler(void);
+uint32_t addCompiledString(ScriptCompiler *, const char *, size_t);
+int addCompiledLine(ScriptCompiler *, const char *, size_t, Command *);
+int writeScriptCache(ScriptCompiler *, const char *, const char *,
+                     const struct stat *);
+void freeScriptCompiler(ScriptCompiler *);
+ScriptCache *loadScriptCache(const char *, const char *, const struct stat *);
+int linkScriptCache(ScriptCache *, size_t);
+void freeScriptCache(ScriptCache *);
 
-char *findExecutable(const char *);
-int openRedirect(Redirect *);
-int redirect(Redirect *);
+LineReader *initLineReader(int);
+int fillLineReader(LineReader *);
+int readLine(LineReader *, const char **, size_t *);
+void syncLineReader(LineReader *);
+void resumeLineReader(LineReader *);
+void freeLineReader(LineReader *);
+
+LineEditor *initLineEditor(int);
+int insertLineEditor(LineEditor *, const char *, size_t);
+void refreshLineEditor(LineEditor *, Writer *, const char *, const char *);
+int searchLineEditor(LineEditor *, Shell *);
+int editLine(LineEditor *, Shell *, const char *, const char **, size_t *);
+void freeLineEditor(LineEditor *);
+
+unsigned int hashString(const char *);
+unsigned int hashBytes(const char *, size_t);
+
+ExecutableCache *initExecutableCache(int);
+ExecutableEntry *getCachedExecutable(const char *, unsigned int,
+                                     ExecutableCache *);
+ExecutableEntry *addCachedExecutable(const char *, const char *,
+                                     ExecutableCache *);
+void clearExecutableCache(ExecutableCache *);
+void freeExecutableCache(ExecutableCache *);
+char *searchPath(const char *, ExecutableCache *);
+const char *findExecutable(const char *, ExecutableCache *);
+int openRedirect(Redirect *, Writer *);
+int redirect(Redirect *, SavedFD *, Writer *);
+void restoreRedirect(SavedFD *, int);
+int getRedirectMoves(Redirect *, FDMove *, Writer *);
+pid_t spawnProcess(const char *, char **, const FDMove *, int);
+pid_t forkProcess(const char *, char **, const FDMove *, int);
+void resetSignalMask(void);
 void freeRedirect(Redirect *);
 
 LocalVariableArray *initLocalVariables(int);
-void addLocalVariable(LocalVariableArray *, LocalVariable *);
-int replaceVariables(Command *, LocalVariableArray *, int);
-void updateLocalVariable(LocalVariableArray *, LocalVariable *);
+LocalVariable **findLocalVariable(const char *, size_t, unsigned int,
+                                  LocalVariableArray *);
+LocalVariable *addLocalVariable(LocalVariableArray *, const char *, size_t);
+int setLocalVariable(LocalVariableArray *, const char *, size_t, const char *);
+int setEnvironmentVariable(LocalVariableArray *, const char *, const char *);
+const char *getVariable(const char *, LocalVariableArray *);
+const char *lookupVariable(const char *, size_t, LocalVariableArray *);
+void initStringBuilder(StringBuilder *, Arena *, size_t);
+void appendString(StringBuilder *, const char *, size_t);
+size_t findClosingBracket(const char *, size_t, size_t);
+int expandArithmetic(StringBuilder *, const char *, size_t, Shell *);
+size_t getVariableNameLen(const char *);
+int expandParameter(StringBuilder *, const char *, size_t, Shell *);
+int expandCommand(StringBuilder *, const char *, size_t, Shell *);
+int isReadOnlyCommand(Command *);
+int captureBuiltin(Command *, Shell *, CaptureBuffer *);
+int captureCommand(Command *, Shell *, CaptureBuffer *);
+int expandDollar(StringBuilder *, const char **, Shell *);
+int expandWord(StringBuilder *, const char *, Shell *);
+int needsExpansion(const char *);
+char *expandTokenInto(StringBuilder *, char *, Shell *);
+char *expandToken(char *, Shell *);
+Command *replaceVariables(Command *, Shell *, int);
 LocalVariable *getLocalVariable(const char *, LocalVariableArray *);
 void freeLocalVariableArray(LocalVariableArray *);
 void freeLocalVariable(LocalVariable *);
 
-Command *getCommand(char *, LocalVariableArray *);
-Command *getCommandCopy(Command *);
+Arena *initArena(size_t);
+void *arenaAlloc(Arena *, size_t);
+char *arenaStrndup(Arena *, const char *, size_t);
+ArenaMark getArenaMark(Arena *);
+void releaseArena(Arena *, ArenaMark);
+void resetArena(Arena *);
+void freeArena(Arena *);
+
+int isBlank(char);
+int isRedirectStart(const char *, size_t, size_t);
+size_t scanWord(const char *, size_t, size_t);
+RedirectMode getRedirectMode(const char *, int *);
+int parseRedirect(Command *, Arena *, Writer *);
+Command *getCommand(const char *, size_t, Arena *, Writer *);
+Command *parseLine(Shell *, const char *, size_t);
+
+BlockKeyword getBlockKeyword(Command *);
+Command *getBlockCondition(Command *, const char *, Arena *, int *);
+BlockParser *initBlockParser(Arena *);
+Node *addBlockNode(BlockParser *, NodeKind, Arena *);
+BlockFrame *pushBlockFrame(BlockParser *, Node *, BlockKeyword, Arena *);
+int addBlockLine(BlockParser *, Command *, Arena *, Writer *);
+int executeNode(Node *, Shell *);
+int isUnquotedExpansion(const char *);
+int executeForNode(Node *, Shell *);
+
+int evaluateArithmetic(const char *, Shell *, long long *);
+void skipArithSpace(ArithParser *);
+int isArithName(char);
+long long getArithVariable(ArithParser *, const char *, size_t);
+void setArithVariable(ArithParser *, const char *, size_t, long long);
+const ArithOperatorInfo *getArithOperator(const char *);
+size_t getArithAssignment(const char *, ArithOperator *);
+long long applyArithOperator(ArithParser *, ArithOperator, long long,
+                             long long);
+long long parseArithAssignment(ArithParser *);
+long long parseArithTernary(ArithParser *);
+long long parseArithBinary(ArithParser *, int);
+long long parseArithUnary(ArithParser *);
+char *getCommandLine(Command *, Arena *, size_t *);
 BuiltinCommandInfo *getBuiltinCommandInfo(Command *);
-void freeCommand(Command *);
-void printCommand(Command *);
 
 History *initHistory(int);
-int addHistory(History *, Command *);
-int compareHistory(Command *CommandA, Command *CommandB);
+HistoryEntry **findHistoryEntry(const char *, size_t, unsigned int, History *);
+HistoryEntry *internHistoryEntry(const char *, size_t, History *);
+void releaseHistoryEntry(HistoryEntry *, History *);
+int pushHistory(History *, const char *, size_t);
+int addHistory(History *, const char *, size_t);
 int setHistoryCapacity(int, History *);
-Command *getHistory(int, History *);
+int openHistoryFile(const char *, History *);
+int loadHistoryFile(History *);
+const char *getHistory(int, History *);
 void freeHistory(History *);
 
+HistoryIndex *initHistoryIndex(void);
+unsigned int getTrigram(const char *);
+TrigramPosting *findTrigramPosting(HistoryIndex *, unsigned int);
+int addTrigram(HistoryIndex *, unsigned int, int);
+int addHistoryIndexLine(HistoryIndex *, const char *, size_t);
+const char *getHistoryIndexLine(HistoryIndex *, int, size_t *);
+int startHistoryIndex(History *);
+void *historyIndexWorker(void *);
+int indexHistoryFile(HistoryIndex *, int, off_t, off_t);
+int joinHistoryIndex(History *, HistoryIndex **);
+HistoryIndex *getHistoryIndex(History *);
+int findHistoryMatch(HistoryIndex *, const char *, size_t, int);
+void freeHistoryIndex(HistoryIndex *);
+
 int compareStrs(const void *a, const void *b);
-int filterDirDotFiles(const struct dirent *);
+Writer *initWriter(int, size_t);
+int writeBytes(Writer *, const char *, size_t);
+int writeFormat(Writer *, const char *, ...)
+    __attribute__((format(printf, 2, 3)));
+int growWriter(Writer *, size_t);
+int flushWriter(Writer *);
+void freeWriter(Writer *);
+ssize_t readDirectoryBatch(int, char *, size_t);
+uint64_t getNameKey(const char *);
+int compareDirEntries(const void *, const void *);
+int streamDirectory(int, Writer *);
+DirEntry *readDirectory(int, Arena *, int *);
+void *statWorker(void *);
+void statDirectory(StatBatch *);
+void formatMode(mode_t, char *);
+void writeLongEntry(Writer *, int, const char *, const struct statx *);
+int listDirectory(int, int, int, Writer *, Arena *);
+
+int openPidFD(pid_t);
+double getTime(void);
+double getTimevalSeconds(struct timeval);
+void getJobUsage(Job *, ResourceUsage *);
+void reportUsage(Shell *, const ResourceUsage *, const char *);
+int isTimeAll(Shell *);
+int getExitStatus(int);
+JobTable *initJobTable(void);
+Job *initJob(int, const char *, size_t);
+JobProcess **findJobProcess(pid_t, JobTable *);
+int addJobProcess(JobProcess *, JobTable *);
+void removeJobProcess(pid_t, JobTable *);
+int watchJobProcess(JobProcess *, JobTable *);
+void reapJobProcess(JobProcess *, int, const struct rusage *, JobTable *);
+int pollJobs(JobTable *, int);
+int waitJob(Job *, JobTable *);
+int addJob(Job *, JobTable *);
+int findJob(const char *, JobTable *);
+void removeJob(int, JobTable *);
+void updateJobs(Shell *);
+void freeJob(Job *);
+void freeJobTable(JobTable *);
+
+ParallelRunner *initParallelRunner(Shell *);
+int isParallelCommand(Command *);
+int hasExpansionAssignment(const char *);
+int hasArithmeticAssignment(const char *);
+int launchParallelLine(ParallelRunner *, Command *, Shell *);
+int captureParallelBuiltin(ParallelLine *, Command *, Shell *);
+int growCapture(CaptureBuffer *, size_t);
+int readCapture(CaptureBuffer *, int);
+int writeAllVector(int, struct iovec *, int);
+void flushShellOutput(Shell *);
+void flushShellErrors(Shell *);
+int writeAll(int, const char *, size_t);
+int isParallelLineDone(ParallelLine *);
+void stepParallelRunner(ParallelRunner *, Shell *, int);
+void freeParallelLine(ParallelLine *);
+void freeParallelRunner(ParallelRunner *);
+
+Profiler *initProfiler(const char *);
+double startSpan(Shell *);
+void endSpan(Shell *, const char *, double);
+double startLineSpan(Shell *);
+void endLineSpan(Shell *, const char *, size_t, double);
+void addProfileSpan(Profiler *, const char *, double, double);
+void writeJSONString(Writer *, const char *);
+int writeProfile(Profiler *);
+int compareProfileLines(const void *, const void *, void *);
+void reportProfile(Profiler *, Writer *);
+void freeProfiler(Profiler *);
+
+void resetStats(Shell *);
+void recordLatency(LatencyHistogram *, double, double);
+double getLatencyPercentile(const LatencyHistogram *, double);
+void writeLatencyHistogram(Writer *, const char *, const LatencyHistogram *);
+void writeLatencyHistogramJSON(Writer *, const char *,
+                               const LatencyHistogram *);
 
+int getPipeSize(Shell *);
+pid_t launchStage(Command *, Shell *, int, int, int);
+int launchJob(Job *, Command *, Shell *, int, int, int);
+int executePipeline(Command *, Shell *, const char *, size_t);
 int execute(Command *, Shell *);
+void measureBuiltin(Shell *, double, const struct rusage *);
 int executeExitCommand(Command *, Shell *);
 int executeCdCommand(Command *, Shell *);
 int executeExportCommand(Command *, Shell *);
 int executeLocalCommand(Command *, Shell *);
 int executeVarsCommand(Command *, Shell *);
 int executeHistoryCommand(Command *, Shell *);
+int searchHistory(Command *, Shell *);
 int executeLsCommand(Command *, Shell *);
+int executeHashCommand(Command *, Shell *);
+int executeStatsCommand(Command *, Shell *);
+int executeJobsCommand(Command *, Shell *);
+int executeWaitCommand(Command *, Shell *);
+int executeFgCommand(Command *, Shell *);
+int executeTimeCommand(Command *, Shell *);
+int executeBuiltinCommand(Command *, Shell *);
+int executeEchoCommand(Command *, Shell *);
+int executeTrueCommand(Command *, Shell *);
+int executeFalseCommand(Command *, Shell *);
+int executeTestCommand(Command *, Shell *);
+int parseTestOr(TestParser *);
+int parseTestAnd(TestParser *);
+int parseTestNot(TestParser *);
+int parseTestPrimary(TestParser *);
+int isTestBinaryOperator(const char *);
+int evaluateTestUnary(const char *, const char *);
+int evaluateTestBinary(TestParser *, const char *, const char *,
+                       const char *);
+int parseTestInteger(TestParser *, const char *, long long *);
+int executePrintfCommand(Command *, Shell *);
+int getPrintfArgument(const char *, char, long long *, double *);
+const char *writeEscape(Writer *, const char *, int, int *);
+int writeEscaped(Writer *, const char *, int);
+void writeQuoted(Writer *, const char *);
+int executeCatCommand(Command *, Shell *);
+int copyToWriter(int, Writer *);
 
 #endif